@@ -4,6 +4,7 @@
 //
 // Handles the parsing of command line arguments, and displaying documentation on usage to the user.
 
+#include <array>
 #include <map>
 #include <set>
 #include <string>
@@ -49,15 +50,20 @@ void print_usage(char const* exe_name) {
     std::cout << "Usage:\n";
     std::cout << "    " << exe_short_name
         << " --hide -m <message file> -c <coverfile> -o <stego file> [-t <threshold>]\n"
-        << "        [--rmax <n>] [--gmax <n>] [--bmax <n>] [--amax <n>]\n";
+        << "        [--rmax <n>] [--gmax <n>] [--bmax <n>] [--amax <n>] [--auto-planes]\n"
+        << "        [--message-size <bytes>]\n";
     std::cout << "    " << exe_short_name
         << " --hide --random <count> -c <coverfile> -o <stego file> [-t <threshold>]\n"
-        << "        [--rmax <n>] [--gmax <n>] [--bmax <n>] [--amax <n>]\n";
+        << "        [--rmax <n>] [--gmax <n>] [--bmax <n>] [--amax <n>] [--auto-planes]\n";
     std::cout << "    " << exe_short_name
-        << " --extract -s <stego file> -o <message file>\n";
+        << " --extract -s <stego file> -o <message file> [--planes <r,g,b,a>]\n";
     std::cout << "    " << exe_short_name
         << " --measure -c <cover file> -t <threshold>\n"
         << "        [--rmax <n>] [--gmax <n>] [--bmax <n>] [--amax <n>]\n";
+    std::cout << "    " << exe_short_name
+        << " --capacity-table -c <cover file>\n";
+    std::cout << "    " << exe_short_name
+        << " --probe -s <stego file> [--json]\n";
     std::cout << "    " << exe_short_name << " --help\n";
 
     std::cout << "\n(try --help for more details)\n";
@@ -73,11 +79,20 @@ void print_help(char const* argv0) {
         "  --hide              Hide message in cover image",
         "  --extract           Extract hidden message",
         "  --measure           Measure hiding capacity of an image",
+        "  --capacity-table    Measure hiding capacity for all thresholds and bitplane limits",
+        "  --probe             Check for a hidden message, without extracting it",
         "  --help              Display this help message",
         "",
+        "General Options:",
+        "  --threads <n>       Number of threads to use (default=one per core)",
+        "  --perm-cache <dir>  Directory in which to save chunk orders, for reuse by later runs",
+        "",
         "Hide Mode Options:",
         "  -c <coverfile>      Cover image to hide message in",
-        "  -m <message file>   Message file to hide. Exclusive with --random.",
+        "  -m <message file>   Message file to hide, or - for standard input. Exclusive with",
+        "                      --random.",
+        "  --message-size <n>  Expected size of the message, in bytes, when it is read from",
+        "                      standard input. Only a hint, to avoid growing the buffer.",
         "  --random <count>    Fill cover file with <count> random bytes. Exclusive with -m.",
         "  -o <stego file>     Name of output stego image file",
         "  -t <threshold>      Complexity threshold [0, 0.5]. default=dynamic threshold",
@@ -85,10 +100,15 @@ void print_help(char const* argv0) {
         "  --gmax <n>          Max green bitplanes to use ([0,8], default={BP})",
         "  --bmax <n>          Max blue bitplanes to use ([0,8], default={BP})",
         "  --amax <n>          Max alpha bitplanes to use ([0,8], default={BP})",
+        "  --auto-planes       Choose the bitplanes which change the image the least.",
+        "                      Exclusive with --rmax, --gmax, --bmax and --amax.",
         "",
         "Extract Mode Options:",
         "  -s <stego file>     Stego file to extract hidden message from",
         "  -o <message file>   Name of output message file",
+        "  --planes <r,g,b,a>  Bitplanes the message was hidden with (the --rmax, --gmax,",
+        "                      --bmax and --amax used for hiding), so they don't have to",
+        "                      be searched for",
         "",
         "Measure Mode Options:",
         "  -c <cover file>     Cover image to measure for capacity",
@@ -98,11 +118,22 @@ void print_help(char const* argv0) {
         "  --bmax <n>          Max blue bitplanes to use ([0,8], default={BP})",
         "  --amax <n>          Max alpha bitplanes to use ([0,8], default={BP})",
         "",
+        "Capacity Table Mode Options:",
+        "  -c <cover file>     Cover image to measure for capacity",
+        "",
+        "Probe Mode Options:",
+        "  -s <stego file>     Image to check for a hidden message",
+        "  --json              Output the result as a JSON object, on one line",
+        "",
         "Examples:",
         "  {steg.exe} --hide -c cover.jpg -m message.txt --amax 0 -o hidden.png",
         "       Hide message.txt in cover.jpg. Do not use any bitplanes from the",
         "       alpha channel. Output to hidden.png",
         "",
+        "  {steg.exe} --hide -c cover.png -m message.txt --auto-planes -o hidden.png",
+        "       Hide message.txt in cover.png, in whichever bitplanes fit it with",
+        "       the least change to the image. Output to hidden.png",
+        "",
         "  {steg.exe} --extract -s hidden.png -o extracted.txt",
         "       Extract a hidden message from hidden.png. Output to extracted.txt",
         "",
@@ -111,11 +142,24 @@ void print_help(char const* argv0) {
         "       = 0.3, using 4 bitplanes each for the red, green and blue channels,",
         "       and 2 bitplanes for the alpha channel.",
         "",
+        "  {steg.exe} --capacity-table -c cover.bmp > capacity.csv",
+        "       Write the hiding capacity of cover.bmp as CSV, one row for each",
+        "       combination of --rmax, --gmax, --bmax and --amax, and one column",
+        "       for each threshold from 0 to 0.5.",
+        "",
+        "  {steg.exe} --probe -s hidden.png --json",
+        "       Check whether hidden.png has a message hidden in it, and if so, which",
+        "       bitplanes it was hidden in and how big it is.",
+        "",
         "  {steg.exe} --hide -c cover.png -m - -o hidden.tga",
         "       Read a message from standard input (note the '-' in place of a",
         "       filename), hide it in cover.png, output to hidden.tga. The",
         "       message can also be piped in this way.",
         "",
+        "  tar cz docs | {steg.exe} --hide -c cover.png -m - --message-size 500000 -o hidden.png",
+        "       Hide a compressed tarball piped in on standard input. It is read as",
+        "       binary, so it is hidden byte for byte.",
+        "",
         "  {steg.exe} --extract -s hidden.tga -o -",
         "       Extract hidden message and output to standard output. Not",
         "       recommended on Windows unless you know for sure that the",
@@ -203,6 +247,33 @@ struct RawArgs {
         auto err = oss.str();
         throw std::runtime_error(err);
     }
+
+    // Gets a list of 4 comma separated bitplane counts, each in [0,8], such as "4,4,4,0". Throws an
+    // exception if the argument is missing or isn't in that form.
+    std::array<u8, 4> get_bitplane_counts_or_throw(std::string const& arg_name) const {
+        auto value = get_value_or_throw(arg_name);
+        std::array<u8, 4> counts = {};
+
+        std::istringstream iss(value);
+        bool valid = true;
+        for (size_t i = 0; i < 4 && valid; i++) {
+            int count = -1;
+            char separator = ',';
+            if (i > 0)
+                iss >> separator;
+            iss >> count;
+            valid = iss && separator == ',' && count >= 0 && count <= 8;
+            counts[i] = (u8)count;
+        }
+
+        if (!valid || iss.peek() != EOF) {
+            std::ostringstream oss;
+            oss << arg_name << " should be 4 integers in range [0, 8], separated by commas";
+            auto err = oss.str();
+            throw std::runtime_error(err);
+        }
+        return counts;
+    }
 };
 
 // Parses the command line arguments. <flag_names> are the arguments which are flags, that is, they
@@ -267,10 +338,12 @@ RawArgs collect_raw_args(int argc, char** _argv,
 Args parse_args(int argc, char** argv) {
     auto raw_args = collect_raw_args(argc, argv,
         // flags
-        {"--hide", "--extract", "--measure", "--help"},
+        {"--hide", "--extract", "--measure", "--capacity-table", "--probe", "--auto-planes",
+            "--json", "--help"},
 
         // value args
-        {"-m", "-c", "-o", "-s", "-t", "--rmax", "--gmax", "--bmax", "--amax", "--random"}
+        {"-m", "-c", "-o", "-s", "-t", "--rmax", "--gmax", "--bmax", "--amax", "--random",
+            "--message-size", "--threads", "--perm-cache", "--planes"}
     );
 
     Args args = {};
@@ -284,15 +357,18 @@ Args parse_args(int argc, char** argv) {
     args.hide = raw_args.arg_is_present("--hide");
     args.extract = raw_args.arg_is_present("--extract");
     args.measure = raw_args.arg_is_present("--measure");
+    args.capacity_table = raw_args.arg_is_present("--capacity-table");
+    args.probe = raw_args.arg_is_present("--probe");
     bool message_is_random = raw_args.arg_is_present("--random");
 
     // here we're using the conversion of boolean false -> 0, true -> 1 to count selected modes
-    int num_modes = (int)args.hide + (int)args.extract + (int)args.measure;
+    int num_modes = (int)args.hide + (int)args.extract + (int)args.measure
+        + (int)args.capacity_table + (int)args.probe;
 
-    // At least one mode (hide, extract or measure) must be selected
+    // At least one mode (hide, extract, measure, capacity table or probe) must be selected
     if (num_modes == 0) {
         std::ostringstream oss;
-        oss << "no mode selected (--hide, --extract or --measure)";
+        oss << "no mode selected (--hide, --extract, --measure, --capacity-table or --probe)";
         auto err = oss.str();
         throw std::runtime_error(err);
     }
@@ -300,7 +376,8 @@ Args parse_args(int argc, char** argv) {
     // No more than one mode can be selected
     if (num_modes > 1) {
         std::ostringstream oss;
-        oss << "multiple modes selected (choose one of --hide, --extract or --measure)";
+        oss << "multiple modes selected "
+            << "(choose one of --hide, --extract, --measure, --capacity-table or --probe)";
         auto err = oss.str();
         throw std::runtime_error(err);
     }
@@ -312,21 +389,48 @@ Args parse_args(int argc, char** argv) {
         // --random is exlusive with -m. If one is present, the other is not allowed.
         if (message_is_random) {
             required_args = {"--hide", "--random", "-c", "-o"};
-            allowed_args = {"-t", "--rmax", "--gmax", "--bmax", "--amax"};
         } else {
             required_args = {"--hide", "-m", "-c", "-o"};
-            allowed_args = {"-t", "--rmax", "--gmax", "--bmax", "--amax"};
+
+            // --message-size is only for a message read from standard input, since a file's size
+            // is already known
+            if (raw_args.arg_is_present("--message-size") && raw_args.arg_is_present("-m")
+                && raw_args.get_value_or_throw("-m") != "-")
+            {
+                std::ostringstream oss;
+                oss << "--message-size is only allowed with -m - (standard input)";
+                auto err = oss.str();
+                throw std::runtime_error(err);
+            }
+            allowed_args = {"--message-size"};
         }
+
+        // --auto-planes picks the bitplane limits itself, so they can't be given too
+        args.auto_planes = raw_args.arg_is_present("--auto-planes");
+        if (args.auto_planes)
+            allowed_args.insert({"-t", "--auto-planes"});
+        else
+            allowed_args.insert({"-t", "--rmax", "--gmax", "--bmax", "--amax"});
     } else if (args.extract) {
         required_args = {"--extract", "-s", "-o"};
+        allowed_args = {"--planes"};
     } else if (args.measure) {
         required_args = {"--measure", "-c", "-t"};
         allowed_args = {"--rmax", "--gmax", "--bmax", "--amax"};
+    } else if (args.capacity_table) {
+        required_args = {"--capacity-table", "-c"};
+    } else if (args.probe) {
+        required_args = {"--probe", "-s"};
+        allowed_args = {"--json"};
     }
 
     // required args are also allowed args, obviously
     allowed_args.insert(required_args.begin(), required_args.end());
 
+    // options that apply to every mode
+    allowed_args.insert("--threads");
+    allowed_args.insert("--perm-cache");
+
     // throw an error if any of the required args are not present
     for (auto& arg : required_args) {
         if (!raw_args.arg_is_present(arg)) {
@@ -360,6 +464,8 @@ Args parse_args(int argc, char** argv) {
         } else {
             args.message_file = raw_args.get_value_or_throw("-m");
             args.random_count = -1;
+            args.message_size = (size_t)raw_args.get_integer_or_default_with_range(
+                "--message-size", 0, 0, 2000000000);
         }
         args.cover_file = raw_args.get_value_or_throw("-c");
         args.output_file = raw_args.get_value_or_throw("-o");
@@ -381,6 +487,15 @@ Args parse_args(int argc, char** argv) {
     } else if (args.extract) {
         args.stego_file = raw_args.get_value_or_throw("-s");
         args.output_file = raw_args.get_value_or_throw("-o");
+
+        args.known_planes = raw_args.arg_is_present("--planes");
+        if (args.known_planes) {
+            auto counts = raw_args.get_bitplane_counts_or_throw("--planes");
+            args.rmax = counts[0];
+            args.gmax = counts[1];
+            args.bmax = counts[2];
+            args.amax = counts[3];
+        }
     } else if (args.measure) {
         args.cover_file = raw_args.get_value_or_throw("-c");
         args.threshold = raw_args.get_float_or_default_with_range("-t", 0.3f, 0.0f, 0.5f);
@@ -388,7 +503,19 @@ Args parse_args(int argc, char** argv) {
         args.gmax = (u8)raw_args.get_integer_or_default_with_range("--gmax", DEFAULT_BITPLANE_USAGE, 0, 8);
         args.bmax = (u8)raw_args.get_integer_or_default_with_range("--bmax", DEFAULT_BITPLANE_USAGE, 0, 8);
         args.amax = (u8)raw_args.get_integer_or_default_with_range("--amax", DEFAULT_BITPLANE_USAGE, 0, 8);
+    } else if (args.capacity_table) {
+        args.cover_file = raw_args.get_value_or_throw("-c");
+    } else if (args.probe) {
+        args.stego_file = raw_args.get_value_or_throw("-s");
+        args.json = raw_args.arg_is_present("--json");
     }
 
+    // 0 means one thread per processor core
+    args.threads = (size_t)raw_args.get_integer_or_default_with_range("--threads", 0, 1, 1024);
+
+    // empty means the chunk orders are only kept in memory
+    if (raw_args.arg_is_present("--perm-cache"))
+        args.permutation_cache_dir = raw_args.get_value_or_throw("--perm-cache");
+
     return args;
 }
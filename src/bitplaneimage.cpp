@@ -0,0 +1,190 @@
+// Benjamin Lindley, Vanessa Martinez
+//
+// bitplaneimage.cpp
+//
+// A BitplaneImage holds some of the bitplanes of an image, split into DataChunks. This is the form
+// the cover image takes for all of the BPCS work: measuring the complexity threshold, hiding and
+// extracting.
+//
+// Each bitplane's chunks are stored in spatial order, one per 8x8 block of the image, left to right
+// and top to bottom. So converting from and to an Image is a single walk through the image, in
+// order, with every chunk landing next to the one before it. The randomized order in which hiding
+// and extracting use the chunks (see for_each_chunk_priority(...)) is kept separately, as an index
+// into the spatial order. Anything which needs that order goes through a BitplaneView, and anything
+// which doesn't, like counting complex chunks, can just run straight through the chunks.
+//
+// The number of bit transitions of every chunk is counted once, while the image is being split up,
+// and kept next to the chunks. Finding the threshold, hiding and extracting all read it from there
+// instead of counting again.
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "declarations.h"
+
+// Returns the position of a bitplane within <bitplanes>, and so within <chunks> and <chunk_order>
+size_t BitplaneImage::bitplane_position(size_t bitplane_index) const {
+    for (size_t i = 0; i < bitplanes.size(); i++) {
+        if (bitplanes[i] == bitplane_index)
+            return i;
+    }
+
+    auto err = "bitplane not present in bitplane image";
+    throw std::logic_error(err);
+}
+
+// Returns a pointer to the first chunk of a bitplane, in spatial order
+DataChunk const* BitplaneImage::bitplane_begin(size_t bitplane_index) const {
+    return chunks.data() + bitplane_position(bitplane_index) * chunks_per_bitplane;
+}
+
+DataChunk* BitplaneImage::bitplane_begin(size_t bitplane_index) {
+    return chunks.data() + bitplane_position(bitplane_index) * chunks_per_bitplane;
+}
+
+// Returns a pointer to the transition count of the first chunk of a bitplane, in spatial order
+u8 const* BitplaneImage::bitplane_transitions(size_t bitplane_index) const {
+    return transitions.data() + bitplane_position(bitplane_index) * chunks_per_bitplane;
+}
+
+// Counts the transitions of every chunk again. Only needed when <chunks> was filled in by hand.
+void BitplaneImage::recount_transitions() {
+    transitions.resize(chunks.size());
+    count_transitions(chunks.data(), chunks.size(), transitions.data());
+}
+
+// Returns a view of a bitplane's chunks, in the randomized order used for hiding
+BitplaneView BitplaneImage::view(size_t bitplane_index) {
+    size_t offset = bitplane_position(bitplane_index) * chunks_per_bitplane;
+    return { chunks.data() + offset, transitions.data() + offset, chunk_order.data() + offset,
+        chunks_per_bitplane };
+}
+
+ConstBitplaneView BitplaneImage::view(size_t bitplane_index) const {
+    size_t offset = bitplane_position(bitplane_index) * chunks_per_bitplane;
+    return { chunks.data() + offset, transitions.data() + offset, chunk_order.data() + offset,
+        chunks_per_bitplane };
+}
+
+// Splits the given bitplanes of an image into chunks
+//
+// A DataChunk is an 8x8 bit chunk of a single bitplane of the image. For images in which the width
+// or height is not divisible by 8, the excess pixels on the right side or bottom are simply skipped
+// over, so there is no problem in handling images of any size.
+//
+// Only the bitplanes listed in <bitplanes> are split out, and they are stored in that order. This
+// is usually the list returned by generate_bitplane_priority(...), so that bitplanes which will
+// never be used for hiding don't cost any time or memory.
+//
+// BPCS works with the bitplanes of the gray coded image (see binary_to_gray_code(...)), so the
+// chunks are converted to gray code as each block is sliced (see binary_to_gray_code_chunks(...)).
+// The image itself stays in plain binary and is not modified.
+//
+// The bit shuffling is done by slice_block(...), which turns one 8x8 block of pixels into all 32 of
+// its chunks at once. <kernel> selects which instruction set does the slicing. Every kernel gives
+// identical results. The image is split into horizontal bands of blocks which are sliced on
+// separate threads (see parallel_for(...)). The transitions of each row of blocks are counted
+// right after it is sliced, while its chunks are still in the cache.
+BitplaneImage BitplaneImage::from_image(Image const& img, std::vector<size_t> const& bitplanes,
+    SliceKernel const& kernel)
+{
+    size_t chunks_in_width = img.width / 8;
+    size_t chunks_in_height = img.height / 8;
+    size_t chunks_per_bitplane = chunks_in_width * chunks_in_height;
+    size_t row_stride = img.width * 4;
+    size_t bitplane_count = bitplanes.size();
+
+    BitplaneImage planes;
+    planes.width = img.width;
+    planes.height = img.height;
+    planes.chunks_per_bitplane = chunks_per_bitplane;
+    planes.bitplanes = bitplanes;
+    planes.chunks.resize(chunks_per_bitplane * bitplane_count);
+    planes.transitions.resize(chunks_per_bitplane * bitplane_count);
+    planes.chunk_order.resize(chunks_per_bitplane * bitplane_count);
+
+    auto& transition_kernel = best_transition_kernel();
+
+    auto slice_band = [&](size_t y_begin, size_t y_end) {
+        for (size_t y = y_begin; y < y_end; y++) {
+            for (size_t x = 0; x < chunks_in_width; x++) {
+                size_t block_index = y * chunks_in_width + x;
+                auto block_ptr = img.pixel_data.data() + y * 8 * row_stride + x * 8 * 4;
+
+                DataChunk sliced[32];
+                kernel.slice_block(block_ptr, row_stride, sliced);
+                binary_to_gray_code_chunks(sliced);
+
+                for (size_t i = 0; i < bitplane_count; i++)
+                    planes.chunks[i * chunks_per_bitplane + block_index] = sliced[bitplanes[i]];
+            }
+
+            size_t row_begin = y * chunks_in_width;
+            for (size_t i = 0; i < bitplane_count; i++) {
+                size_t offset = i * chunks_per_bitplane + row_begin;
+                transition_kernel.count_transitions(planes.chunks.data() + offset, chunks_in_width,
+                    planes.transitions.data() + offset);
+            }
+        }
+    };
+
+    parallel_for(chunks_in_height, slice_band);
+
+    auto bitplane_op = [&](size_t, size_t position, std::vector<u32> const& chunk_priority) {
+        std::copy(chunk_priority.begin(), chunk_priority.end(),
+            planes.chunk_order.begin() + position * chunks_per_bitplane);
+    };
+
+    for_each_chunk_priority(img.width, img.height, bitplanes, bitplane_op);
+
+    return planes;
+}
+
+// Writes the given blocks' chunks back into an image
+//
+// Each block is put back together by <kernel>, after converting its chunks from gray code back to
+// plain binary. Bitplanes which are not held are left as they are. <block_indices> must not
+// contain duplicates, because the blocks are split between threads.
+void BitplaneImage::blocks_to_image(Image& img, std::vector<size_t> const& block_indices,
+    SliceKernel const& kernel) const
+{
+    size_t chunks_in_width = img.width / 8;
+    size_t row_stride = img.width * 4;
+    size_t bitplane_count = bitplanes.size();
+
+    if (img.width != width || img.height != height) {
+        auto err = "bitplane image does not match the size of the image";
+        throw std::logic_error(err);
+    }
+
+    parallel_for(block_indices.size(), [&](size_t i_begin, size_t i_end) {
+        for (size_t i = i_begin; i < i_end; i++) {
+            size_t block_index = block_indices[i];
+            size_t x = block_index % chunks_in_width;
+            size_t y = block_index / chunks_in_width;
+            auto block_ptr = img.pixel_data.data() + y * 8 * row_stride + x * 8 * 4;
+
+            // slice the block first, so that the bitplanes we don't hold are written back unchanged
+            DataChunk sliced[32];
+            if (bitplane_count < 32) {
+                kernel.slice_block(block_ptr, row_stride, sliced);
+                binary_to_gray_code_chunks(sliced);
+            }
+
+            for (size_t p = 0; p < bitplane_count; p++)
+                sliced[bitplanes[p]] = chunks[p * chunks_per_bitplane + block_index];
+
+            gray_code_to_binary_chunks(sliced);
+            kernel.unslice_block(sliced, block_ptr, row_stride);
+        }
+    });
+}
+
+// Writes all of the held bitplanes back into an image. This simply reverses from_image(...).
+void BitplaneImage::to_image(Image& img, SliceKernel const& kernel) const {
+    std::vector<size_t> block_indices(chunks_per_bitplane);
+    for (size_t i = 0; i < chunks_per_bitplane; i++)
+        block_indices[i] = i;
+
+    blocks_to_image(img, block_indices, kernel);
+}
@@ -0,0 +1,462 @@
+// Benjamin Lindley, Vanessa Martinez
+//
+// bitslice.cpp
+//
+// Converts between 8x8 blocks of rgba pixels and the 32 bitplane DataChunks of those blocks. This
+// is the innermost loop of converting between an Image and a BitplaneImage, so instead of moving
+// one bit at a time, the bits are moved 64 at a time by treating 8 bytes as an 8x8 matrix of bits
+// and transposing it.
+//
+// There are also SSE2, AVX2 and AVX-512 versions of the same conversion. The one to use is picked
+// at runtime based on what the processor supports, so the same executable runs everywhere.
+
+#include <cstring>
+
+#include "declarations.h"
+
+#if STEG_X86
+#include <immintrin.h>
+#endif
+
+// Transposes an 8x8 matrix of bits packed into a 64-bit word
+//
+// Row 0 of the matrix is the most significant byte of the word, and column 0 of each row is the
+// most significant bit of the byte. Each step swaps the off-diagonal parts of 2x2, then 4x4, then
+// 8x8 sub-matrices. See Hacker's Delight, section 7-3.
+u64 transpose_8x8(u64 x) {
+    u64 t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+// Slices an 8x8 block of rgba pixels into its 32 bitplane chunks
+//
+// <block_ptr> points to the top left pixel of the block, and <row_stride> is the distance in bytes
+// between the start of one row of pixels and the next. chunks_out[i] receives the chunk for
+// bitplane i (see generate_bitplane_priority(...) for how the bitplanes are numbered).
+//
+// For a single row of the block and a single color channel, the 8 bytes of that channel form an
+// 8x8 bit matrix, where row x is the byte of pixel x, and column k is bit k of that byte (MSB
+// first). The transpose of that matrix has bitplane k in row k, with pixel 0 in the MSB, which is
+// exactly the layout of one row of a DataChunk.
+void slice_block_scalar(u8 const* block_ptr, size_t row_stride, DataChunk* chunks_out) {
+    for (size_t row = 0; row < 8; row++) {
+        u8 const* row_ptr = block_ptr + row * row_stride;
+
+        for (size_t channel = 0; channel < 4; channel++) {
+            u64 matrix = 0;
+            for (size_t x = 0; x < 8; x++) {
+                matrix = (matrix << 8) | row_ptr[x * 4 + channel];
+            }
+
+            matrix = transpose_8x8(matrix);
+
+            for (size_t k = 0; k < 8; k++) {
+                chunks_out[channel * 8 + k].bytes[row] = (u8)(matrix >> (56 - k * 8));
+            }
+        }
+    }
+}
+
+// Reverses slice_block_scalar(...), writing 32 bitplane chunks back into an 8x8 block of pixels
+void unslice_block_scalar(DataChunk const* chunks, u8* block_ptr, size_t row_stride) {
+    for (size_t row = 0; row < 8; row++) {
+        u8* row_ptr = block_ptr + row * row_stride;
+
+        for (size_t channel = 0; channel < 4; channel++) {
+            u64 matrix = 0;
+            for (size_t k = 0; k < 8; k++) {
+                matrix = (matrix << 8) | chunks[channel * 8 + k].bytes[row];
+            }
+
+            matrix = transpose_8x8(matrix);
+
+            for (size_t x = 0; x < 8; x++) {
+                row_ptr[x * 4 + channel] = (u8)(matrix >> (56 - x * 8));
+            }
+        }
+    }
+}
+
+// Converts the 32 chunks of a block, as returned by slice_block(...), to gray code
+//
+// Gray coding a byte is (byte >> 1) ^ byte. Shifting right moves each bit into the next less
+// significant bitplane of the same channel, so for the sliced chunks this is just each bitplane
+// XORed with the bitplane above it. That is 28 XORs of 64 bits per block, which lets BitplaneImage
+// handle gray code on the fly, instead of converting the whole image before and after.
+void binary_to_gray_code_chunks(DataChunk* chunks) {
+    for (size_t channel = 0; channel < 4; channel++) {
+        u64 planes[8];
+        std::memcpy(planes, chunks + channel * 8, sizeof(planes));
+        for (size_t k = 7; k > 0; k--)
+            planes[k] ^= planes[k - 1];
+        std::memcpy(chunks + channel * 8, planes, sizeof(planes));
+    }
+}
+
+// Reverses binary_to_gray_code_chunks(...). Each bitplane is XORed with the already converted
+// bitplane above it, starting from the most significant one.
+void gray_code_to_binary_chunks(DataChunk* chunks) {
+    for (size_t channel = 0; channel < 4; channel++) {
+        u64 planes[8];
+        std::memcpy(planes, chunks + channel * 8, sizeof(planes));
+        for (size_t k = 1; k < 8; k++)
+            planes[k] ^= planes[k - 1];
+        std::memcpy(chunks + channel * 8, planes, sizeof(planes));
+    }
+}
+
+#if STEG_X86
+
+// The SIMD versions of slicing work on the sign bits of bytes, which can be gathered 16, 32 or 64
+// at a time with a single movemask instruction. Before that, the bytes of each row need to be
+// rearranged from rgbargba... order to rrrrrrrrgggggggg... order, with pixel 7 first, so that each
+// group of 8 mask bits forms one row of a chunk with pixel 0 in the MSB. Then adding each byte to
+// itself shifts the next bit into the sign position, and we repeat for all 8 bits.
+//
+// The rearrangement works within 128-bit lanes. <hi> holds pixels 4-7 and <lo> holds pixels 0-3 of
+// one row. On return, <hi> holds red then green, and <lo> holds blue then alpha.
+STEG_TARGET("sse2")
+static inline void deinterleave_row_sse2(__m128i& hi, __m128i& lo) {
+    __m128i a = _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 1, 2, 3));
+    __m128i b = _mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 1, 2, 3));
+    __m128i t0 = _mm_unpacklo_epi8(a, b);
+    __m128i t1 = _mm_unpackhi_epi8(a, b);
+    __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+    __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+    hi = _mm_unpacklo_epi8(u0, u1);
+    lo = _mm_unpackhi_epi8(u0, u1);
+}
+
+// Writes out all 32 chunks of a block. masks[k][row] holds the given row of bitplane k of all four
+// channels, one channel per byte. For each k, that is a 8x4 byte matrix which is transposed into
+// four 8 byte chunks, using the same rearrangement as deinterleave_row_sse2(...).
+STEG_TARGET("sse2")
+static inline void store_chunks_sse2(u32 const (*masks)[8], DataChunk* chunks_out) {
+    for (size_t k = 0; k < 8; k++) {
+        __m128i a = _mm_loadu_si128((__m128i const*)masks[k]);
+        __m128i b = _mm_loadu_si128((__m128i const*)(masks[k] + 4));
+        __m128i t0 = _mm_unpacklo_epi8(a, b);
+        __m128i t1 = _mm_unpackhi_epi8(a, b);
+        __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+        __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+        __m128i rg = _mm_unpacklo_epi8(u0, u1);
+        __m128i ba = _mm_unpackhi_epi8(u0, u1);
+        _mm_storel_epi64((__m128i*)chunks_out[k].bytes, rg);
+        _mm_storel_epi64((__m128i*)chunks_out[8 + k].bytes, _mm_unpackhi_epi64(rg, rg));
+        _mm_storel_epi64((__m128i*)chunks_out[16 + k].bytes, ba);
+        _mm_storel_epi64((__m128i*)chunks_out[24 + k].bytes, _mm_unpackhi_epi64(ba, ba));
+    }
+}
+
+// Reads in all 32 chunks of a block, the opposite of store_chunks_sse2(...)
+STEG_TARGET("sse2")
+static inline void load_chunks_sse2(DataChunk const* chunks, u32 (*masks)[8]) {
+    for (size_t k = 0; k < 8; k++) {
+        __m128i r = _mm_loadl_epi64((__m128i const*)chunks[k].bytes);
+        __m128i g = _mm_loadl_epi64((__m128i const*)chunks[8 + k].bytes);
+        __m128i b = _mm_loadl_epi64((__m128i const*)chunks[16 + k].bytes);
+        __m128i a = _mm_loadl_epi64((__m128i const*)chunks[24 + k].bytes);
+        __m128i rg = _mm_unpacklo_epi8(r, g);
+        __m128i ba = _mm_unpacklo_epi8(b, a);
+        _mm_storeu_si128((__m128i*)masks[k], _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*)(masks[k] + 4), _mm_unpackhi_epi16(rg, ba));
+    }
+}
+
+STEG_TARGET("sse2")
+void slice_block_sse2(u8 const* block_ptr, size_t row_stride, DataChunk* chunks_out) {
+    u32 masks[8][8];
+    for (size_t row = 0; row < 8; row++) {
+        u8 const* row_ptr = block_ptr + row * row_stride;
+        __m128i rg = _mm_loadu_si128((__m128i const*)(row_ptr + 16));
+        __m128i ba = _mm_loadu_si128((__m128i const*)row_ptr);
+        deinterleave_row_sse2(rg, ba);
+
+        for (size_t k = 0; k < 8; k++) {
+            masks[k][row] = (u32)_mm_movemask_epi8(rg) | ((u32)_mm_movemask_epi8(ba) << 16);
+            rg = _mm_add_epi8(rg, rg);
+            ba = _mm_add_epi8(ba, ba);
+        }
+    }
+
+    store_chunks_sse2(masks, chunks_out);
+}
+
+// The reverse direction doesn't need any rearranging. The row of each chunk is broadcast to every
+// pixel, and each byte tests the one bit which belongs to its pixel. Subtracting the comparison
+// result (0 or -1) shifts that bit into the bottom of the accumulated byte.
+STEG_TARGET("sse2")
+void unslice_block_sse2(DataChunk const* chunks, u8* block_ptr, size_t row_stride) {
+    __m128i const select_lo = _mm_setr_epi32(0x80808080, 0x40404040, 0x20202020, 0x10101010);
+    __m128i const select_hi = _mm_setr_epi32(0x08080808, 0x04040404, 0x02020202, 0x01010101);
+
+    u32 masks[8][8];
+    load_chunks_sse2(chunks, masks);
+
+    for (size_t row = 0; row < 8; row++) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for (size_t k = 0; k < 8; k++) {
+            __m128i m = _mm_set1_epi32((int)masks[k][row]);
+            __m128i bits_lo = _mm_cmpeq_epi8(_mm_and_si128(m, select_lo), select_lo);
+            __m128i bits_hi = _mm_cmpeq_epi8(_mm_and_si128(m, select_hi), select_hi);
+            lo = _mm_sub_epi8(_mm_add_epi8(lo, lo), bits_lo);
+            hi = _mm_sub_epi8(_mm_add_epi8(hi, hi), bits_hi);
+        }
+
+        u8* row_ptr = block_ptr + row * row_stride;
+        _mm_storeu_si128((__m128i*)row_ptr, lo);
+        _mm_storeu_si128((__m128i*)(row_ptr + 16), hi);
+    }
+}
+
+// Same as the SSE2 version, but with two rows of the block side by side in the two lanes
+STEG_TARGET("avx2")
+void slice_block_avx2(u8 const* block_ptr, size_t row_stride, DataChunk* chunks_out) {
+    u32 masks[8][8];
+    for (size_t row = 0; row < 8; row += 2) {
+        u8 const* row_ptr = block_ptr + row * row_stride;
+        __m256i hi = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)(row_ptr + 16))),
+            _mm_loadu_si128((__m128i const*)(row_ptr + row_stride + 16)), 1);
+        __m256i lo = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)row_ptr)),
+            _mm_loadu_si128((__m128i const*)(row_ptr + row_stride)), 1);
+
+        __m256i a = _mm256_shuffle_epi32(hi, _MM_SHUFFLE(0, 1, 2, 3));
+        __m256i b = _mm256_shuffle_epi32(lo, _MM_SHUFFLE(0, 1, 2, 3));
+        __m256i t0 = _mm256_unpacklo_epi8(a, b);
+        __m256i t1 = _mm256_unpackhi_epi8(a, b);
+        __m256i u0 = _mm256_unpacklo_epi8(t0, t1);
+        __m256i u1 = _mm256_unpackhi_epi8(t0, t1);
+        __m256i rg = _mm256_unpacklo_epi8(u0, u1);
+        __m256i ba = _mm256_unpackhi_epi8(u0, u1);
+
+        for (size_t k = 0; k < 8; k++) {
+            u32 m_rg = (u32)_mm256_movemask_epi8(rg);
+            u32 m_ba = (u32)_mm256_movemask_epi8(ba);
+            masks[k][row] = (m_rg & 0xFFFF) | (m_ba << 16);
+            masks[k][row + 1] = (m_rg >> 16) | (m_ba & 0xFFFF0000);
+            rg = _mm256_add_epi8(rg, rg);
+            ba = _mm256_add_epi8(ba, ba);
+        }
+    }
+
+    store_chunks_sse2(masks, chunks_out);
+}
+
+// A whole row of 8 pixels fits in one register
+STEG_TARGET("avx2")
+void unslice_block_avx2(DataChunk const* chunks, u8* block_ptr, size_t row_stride) {
+    __m256i const select = _mm256_setr_epi32(0x80808080, 0x40404040, 0x20202020, 0x10101010,
+        0x08080808, 0x04040404, 0x02020202, 0x01010101);
+
+    u32 masks[8][8];
+    load_chunks_sse2(chunks, masks);
+
+    for (size_t row = 0; row < 8; row++) {
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t k = 0; k < 8; k++) {
+            __m256i m = _mm256_set1_epi32((int)masks[k][row]);
+            __m256i bits = _mm256_cmpeq_epi8(_mm256_and_si256(m, select), select);
+            acc = _mm256_sub_epi8(_mm256_add_epi8(acc, acc), bits);
+        }
+
+        _mm256_storeu_si256((__m256i*)(block_ptr + row * row_stride), acc);
+    }
+}
+
+// Loads 16 bytes from each of 4 consecutive rows into the 4 lanes of a register
+STEG_TARGET("avx512f,avx512bw")
+static inline __m512i load_4_rows_avx512(u8 const* ptr, size_t row_stride) {
+    __m512i x = _mm512_castsi128_si512(_mm_loadu_si128((__m128i const*)ptr));
+    x = _mm512_inserti32x4(x, _mm_loadu_si128((__m128i const*)(ptr + row_stride)), 1);
+    x = _mm512_inserti32x4(x, _mm_loadu_si128((__m128i const*)(ptr + row_stride * 2)), 2);
+    x = _mm512_inserti32x4(x, _mm_loadu_si128((__m128i const*)(ptr + row_stride * 3)), 3);
+    return x;
+}
+
+// Same as the SSE2 version, but with four rows of the block side by side in the four lanes
+STEG_TARGET("avx512f,avx512bw")
+void slice_block_avx512(u8 const* block_ptr, size_t row_stride, DataChunk* chunks_out) {
+    u32 masks[8][8];
+    for (size_t row = 0; row < 8; row += 4) {
+        u8 const* row_ptr = block_ptr + row * row_stride;
+        __m512i hi = load_4_rows_avx512(row_ptr + 16, row_stride);
+        __m512i lo = load_4_rows_avx512(row_ptr, row_stride);
+
+        __m512i a = _mm512_shuffle_epi32(hi, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 1, 2, 3));
+        __m512i b = _mm512_shuffle_epi32(lo, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 1, 2, 3));
+        __m512i t0 = _mm512_unpacklo_epi8(a, b);
+        __m512i t1 = _mm512_unpackhi_epi8(a, b);
+        __m512i u0 = _mm512_unpacklo_epi8(t0, t1);
+        __m512i u1 = _mm512_unpackhi_epi8(t0, t1);
+        __m512i rg = _mm512_unpacklo_epi8(u0, u1);
+        __m512i ba = _mm512_unpackhi_epi8(u0, u1);
+
+        for (size_t k = 0; k < 8; k++) {
+            u64 m_rg = (u64)_mm512_movepi8_mask(rg);
+            u64 m_ba = (u64)_mm512_movepi8_mask(ba);
+            for (size_t i = 0; i < 4; i++) {
+                masks[k][row + i] = (u32)((m_rg >> (i * 16)) & 0xFFFF)
+                    | (u32)(((m_ba >> (i * 16)) & 0xFFFF) << 16);
+            }
+            rg = _mm512_add_epi8(rg, rg);
+            ba = _mm512_add_epi8(ba, ba);
+        }
+    }
+
+    store_chunks_sse2(masks, chunks_out);
+}
+
+// Two rows of 8 pixels fit in one register
+STEG_TARGET("avx512f,avx512bw")
+void unslice_block_avx512(DataChunk const* chunks, u8* block_ptr, size_t row_stride) {
+    __m256i const select_row = _mm256_setr_epi32(0x80808080, 0x40404040, 0x20202020, 0x10101010,
+        0x08080808, 0x04040404, 0x02020202, 0x01010101);
+    __m512i const select = _mm512_inserti64x4(_mm512_castsi256_si512(select_row), select_row, 1);
+    __m512i const one = _mm512_set1_epi8(1);
+
+    u32 masks[8][8];
+    load_chunks_sse2(chunks, masks);
+
+    for (size_t row = 0; row < 8; row += 2) {
+        __m512i acc = _mm512_setzero_si512();
+        for (size_t k = 0; k < 8; k++) {
+            __m512i m = _mm512_inserti64x4(
+                _mm512_castsi256_si512(_mm256_set1_epi32((int)masks[k][row])),
+                _mm256_set1_epi32((int)masks[k][row + 1]), 1);
+            __mmask64 bits = _mm512_test_epi8_mask(m, select);
+            acc = _mm512_add_epi8(acc, acc);
+            acc = _mm512_mask_add_epi8(acc, bits, acc, one);
+        }
+
+        u8* row_ptr = block_ptr + row * row_stride;
+        _mm256_storeu_si256((__m256i*)row_ptr, _mm512_castsi512_si256(acc));
+        _mm256_storeu_si256((__m256i*)(row_ptr + row_stride), _mm512_extracti64x4_epi64(acc, 1));
+    }
+}
+
+#endif // STEG_X86
+
+// Returns all of the slicing kernels which the processor we are running on supports, slowest first
+std::vector<SliceKernel> supported_slice_kernels() {
+    std::vector<SliceKernel> kernels;
+    kernels.push_back({"scalar", slice_block_scalar, unslice_block_scalar});
+#if STEG_X86
+    if (cpu_has_sse2())
+        kernels.push_back({"sse2", slice_block_sse2, unslice_block_sse2});
+    if (cpu_has_avx2())
+        kernels.push_back({"avx2", slice_block_avx2, unslice_block_avx2});
+    if (cpu_has_avx512bw())
+        kernels.push_back({"avx512", slice_block_avx512, unslice_block_avx512});
+#endif
+    return kernels;
+}
+
+// Returns the fastest slicing kernel which the processor we are running on supports
+SliceKernel const& best_slice_kernel() {
+    static SliceKernel const kernel = supported_slice_kernels().back();
+    return kernel;
+}
+
+#ifdef STEG_TEST
+
+#include <gtest/gtest.h>
+#include <random>
+
+TEST(bitslice, transpose_8x8) {
+    std::mt19937_64 gen(12345);
+    for (int i = 0; i < 1000; i++) {
+        u64 x = gen();
+        u64 t = transpose_8x8(x);
+        for (size_t r = 0; r < 8; r++) {
+            for (size_t c = 0; c < 8; c++) {
+                u64 original_bit = (x >> (63 - (r * 8 + c))) & 1;
+                u64 transposed_bit = (t >> (63 - (c * 8 + r))) & 1;
+                ASSERT_EQ(original_bit, transposed_bit);
+            }
+        }
+        ASSERT_EQ(transpose_8x8(t), x);
+    }
+}
+
+TEST(bitslice, slice_unslice_block) {
+    std::mt19937_64 gen(54321);
+    size_t const row_stride = 13 * 4;
+    std::vector<u8> pixels(row_stride * 8);
+    for (auto& b : pixels)
+        b = (u8)gen();
+
+    DataChunk chunks[32];
+    slice_block_scalar(pixels.data(), row_stride, chunks);
+
+    for (size_t bp = 0; bp < 32; bp++) {
+        for (size_t row = 0; row < 8; row++) {
+            for (size_t x = 0; x < 8; x++) {
+                size_t pixel_bit_index = (row * row_stride + x * 4) * 8 + bp;
+                ASSERT_EQ(get_bit(chunks[bp].bytes, row * 8 + x),
+                    get_bit(pixels.data(), pixel_bit_index));
+            }
+        }
+    }
+
+    std::vector<u8> restored(pixels.size());
+    unslice_block_scalar(chunks, restored.data(), row_stride);
+    for (size_t row = 0; row < 8; row++) {
+        for (size_t i = 0; i < 32; i++) {
+            ASSERT_EQ(restored[row * row_stride + i], pixels[row * row_stride + i]);
+        }
+    }
+
+    for (auto& kernel : supported_slice_kernels()) {
+        DataChunk kernel_chunks[32];
+        kernel.slice_block(pixels.data(), row_stride, kernel_chunks);
+        for (size_t bp = 0; bp < 32; bp++) {
+            ASSERT_EQ(kernel_chunks[bp], chunks[bp]) << kernel.name << " bitplane " << bp;
+        }
+
+        std::vector<u8> kernel_restored(pixels.size());
+        kernel.unslice_block(chunks, kernel_restored.data(), row_stride);
+        for (size_t row = 0; row < 8; row++) {
+            for (size_t i = 0; i < 32; i++) {
+                ASSERT_EQ(kernel_restored[row * row_stride + i], pixels[row * row_stride + i])
+                    << kernel.name;
+            }
+        }
+    }
+}
+
+TEST(bitslice, gray_code_chunks) {
+    std::mt19937_64 gen(2468);
+    size_t const row_stride = 8 * 4;
+    std::vector<u8> pixels(row_stride * 8);
+    for (auto& b : pixels)
+        b = (u8)gen();
+
+    std::vector<u8> gray_pixels(pixels.size());
+    for (size_t i = 0; i < pixels.size(); i++)
+        gray_pixels[i] = (u8)((pixels[i] >> 1) ^ pixels[i]);
+
+    DataChunk chunks[32];
+    DataChunk expected[32];
+    slice_block_scalar(pixels.data(), row_stride, chunks);
+    slice_block_scalar(gray_pixels.data(), row_stride, expected);
+
+    binary_to_gray_code_chunks(chunks);
+    for (size_t bp = 0; bp < 32; bp++)
+        ASSERT_EQ(chunks[bp], expected[bp]) << "bitplane " << bp;
+
+    gray_code_to_binary_chunks(chunks);
+    std::vector<u8> restored(pixels.size());
+    unslice_block_scalar(chunks, restored.data(), row_stride);
+    ASSERT_EQ(restored, pixels);
+}
+
+#endif // STEG_TEST
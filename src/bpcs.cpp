@@ -2,8 +2,8 @@
 //
 // bpcs.cpp
 //
-// This is the meat and potatoes of the BPCS algorithm. Gray code conversion, extracting bitplanes,
-// hiding and extracting occur in this file.
+// This is the meat and potatoes of the BPCS algorithm. Extracting bitplanes, hiding and extracting
+// occur in this file. Gray code conversion is in graycode.cpp.
 
 #include <array>
 #include <vector>
@@ -13,34 +13,13 @@
 #include <cassert>
 #include <bit>
 #include <random>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <tuple>
 
 #include "declarations.h"
 
-// Converts a single byte to gray code
-//
-// The reason for this operation is explained here: http://datahide.org/BPCSe/pbc-vs-cgc-e.html
-u8 binary_to_gray_code(u8 binary) {
-    return (binary >> 1) ^ binary;
-}
-
-// Converts a gray code byte back to plain binary
-u8 gray_code_to_binary(u8 gray_code) {
-    u8 temp = gray_code ^ (gray_code >> 4);
-    temp ^= (temp >> 2);
-    temp ^= (temp >> 1);
-    return temp;
-}
-
-// Converts an array of bytes to gray code
-void binary_to_gray_code_inplace(std::vector<u8>& vec) {
-    std::transform(vec.begin(), vec.end(), vec.begin(), binary_to_gray_code);
-}
-
-// Converts an array of gray code bytes back to plain binary
-void gray_code_to_binary_inplace(std::vector<u8>& vec) {
-    std::transform(vec.begin(), vec.end(), vec.begin(), gray_code_to_binary);
-}
-
 // Generates the magic chunks
 //
 // MAGIC_14 is a const array consisting of 14 random bytes generated from random.org These 14 bytes
@@ -74,8 +53,14 @@ bool is_magic(DataChunk const& chunk, size_t magic_chunk_index) {
         auto err = "invalid magic chunk index, you shouldn't be here";
         throw std::logic_error(err);
     }
-    auto magic_bytes = MAGIC_14 + magic_chunk_index * 7;
-    return std::memcmp(chunk.bytes, magic_bytes, 7) == 0;
+
+    // The chunk is compared as one u64, with the last byte, which holds the bitplane limits,
+    // masked off. This is in the same byte order as the chunk in memory, whatever that is.
+    u64 x, magic = 0, mask = 0;
+    std::memcpy(&x, chunk.bytes, 8);
+    std::memcpy(&magic, MAGIC_14 + magic_chunk_index * 7, 7);
+    std::memset(&mask, 0xFF, 7);
+    return ((x ^ magic) & mask) == 0;
 }
 
 // Returns an array containing which specific bitplanes to use, and in what order
@@ -122,248 +107,386 @@ std::vector<size_t> generate_bitplane_priority(u8 rmax, u8 gmax, u8 bmax, u8 ama
     return bitplane_priority;
 }
 
-// Turns out that while C++ random generators are consistent, the shuffle algorithm is not. So I had
-// to write my own.
-template<typename It, typename Gen>
-void fisher_yates_shuffle(It begin, It end, Gen gen) {
-    auto n = std::distance(begin, end);
-    auto last = std::prev(end);
-    while (n > 1) {
-        auto swap_index = gen() % n;
-        if (swap_index != 0) {
-            std::iter_swap(begin, std::next(begin, swap_index));
-        }
-        ++begin;
-        --n;
-    }
-}
-
-// Common code for chunkify and de_chunkify
+// Hides a message in the bitplanes of a cover image, formatting it as it goes
 //
-// chunkify and de_chunkify require almost the exact same code structure, with four nested for
-// loops. There is a slight difference in setup, and a slight difference in the innermost portion of
-// the nested loops. In order to keep them in sync and not repeat the same code twice, this template
-// function extracts the common bits, and takes callbacks to handle the differences
-template<typename ImageT, typename InitT, typename TransferT>
-void chunkify_common(ImageT& img, InitT init_op, TransferT transfer_op) {
-    size_t chunks_in_width = img.width / 8;
-    size_t chunks_in_height = img.height / 8;
-    size_t chunks_per_bitplane = chunks_in_width * chunks_in_height;
-
-    auto chunk_data_ptr = init_op(chunks_per_bitplane);
-    size_t chunk_data_bit_index = 0;
-
-    auto pixel_data_ptr = img.pixel_data.data();
+// Iterate over the chunks in order of bitplane priority (see generate_bitplane_priority(...)),
+// checking their complexity against the threshold, and inserting the chunks from the formatted
+// message at those locations. Note that the first two available chunks are used to store the
+// magic chunks (see generate_magic_chunks(...)). The formatted chunks are made by <formatter> as
+// they are needed, and go straight into the cover. <cover> is either a BitplaneImage holding the
+// bitplanes in <bitplane_priority>, or a LazyCoverImage.
+//
+// <replaced_blocks> has an entry for each block, which is set if any of its chunks were replaced,
+// so that only those blocks need to be written back to the image.
+//
+// Like unhide_formatted_message(...), if more than <max_chunks_read> chunks would have to be read,
+// this gives up and returns false. <chunks_read> counts the chunks which have been gone through, so
+// calling this again, with the same <formatter> and a cover made from the image as it is now,
+// carries on from there.
+template<typename CoverImage>
+static bool hide_formatted_message(HideStats& stats, float threshold, CoverImage& cover,
+    MessageFormatter& formatter, std::vector<u8>& replaced_blocks,
+    std::vector<size_t> const& bitplane_priority, size_t& chunks_read, size_t max_chunks_read)
+{
+    u8 min_transitions = threshold_to_transitions(threshold);
 
-    // Randomize the order by which we iterate through the chunks of each bitplane. Unlike the C
-    // rand() function, the random number generators provided in the C++ <random> header are
-    // guaranteed to be reproducible for any particular seed across all standard compliant
-    // platforms. This is potentially a good place to introduce some encryption, by using the
-    // password to modify the seed.
-    u64 seed = img.width * 1000003 + img.height;
-    std::mt19937_64 gen(seed);
-    std::vector<size_t> chunk_priority;
-    chunk_priority.resize(chunks_per_bitplane);
-    for (size_t i = 0; i < chunks_per_bitplane; i++)
-        chunk_priority[i] = i;
+    // the position of the next chunk in the order they are gone through, across all the bitplanes
+    size_t position = 0;
 
-    for (size_t bp = 0; bp < 32; bp++) {
-        size_t bitplane_index = bp;
+    for (size_t bp = 0; bp < bitplane_priority.size(); bp++) {
+        size_t bitplane_index = bitplane_priority[bp];
+        auto bitplane = cover.view(bitplane_index);
 
-        // We shuffle the chunk priority for every bitplane, so the order is different for each one.
-        // This probably doesn't do anything to help with detectability, but perhaps it makes
-        // extraction harder.
-        fisher_yates_shuffle(chunk_priority.begin(), chunk_priority.end(), gen);
+        // an earlier call which gave up part way through may have gone through these already
+        if (position + bitplane.size <= chunks_read) {
+            position += bitplane.size;
+            continue;
+        }
 
-        for (size_t ci = 0; ci < chunks_per_bitplane; ci++) {
-            size_t chunk_index = chunk_priority[ci];
-            size_t chunk_x_index = chunk_index % chunks_in_width;
-            size_t chunk_y_index = chunk_index / chunks_in_width;
+        for (size_t ci = 0; ci < bitplane.size; ci++, position++) {
+            if (formatter.done())
+                return true;
+            if (position < chunks_read)
+                continue;
+            if (chunks_read == max_chunks_read)
+                return false;
+            chunks_read++;
 
-            for (size_t row_in_chunk = 0; row_in_chunk < 8; row_in_chunk++) {
-                for (size_t col_in_chunk = 0; col_in_chunk < 8; col_in_chunk++) {
-                    size_t pixel_x = chunk_x_index * 8 + col_in_chunk;
-                    size_t pixel_y = chunk_y_index * 8 + row_in_chunk;
-                    size_t pixel_index = pixel_y * img.width + pixel_x;
-                    size_t byte_index = pixel_index * 4;
-                    size_t pixel_data_bit_index = byte_index * 8 + bitplane_index;
+            if (bitplane.transition_count(ci) >= min_transitions) {
+                stats.chunks_used_per_bitplane[bitplane_index]++;
+                stats.chunks_used++;
 
-                    transfer_op(pixel_data_ptr, pixel_data_bit_index,
-                        chunk_data_ptr, chunk_data_bit_index);
-                    ++chunk_data_bit_index;
-                }
+                bitplane.replace(ci, formatter.next_chunk());
+                replaced_blocks[bitplane.block_index(ci)] = 1;
             }
         }
     }
+
+    return true;
 }
 
-// Returns an array of DataChunks from the bitplanes of the image
-//
-// A DataChunk is an 8x8 bit chunk of a single bitplane of the image. The chunks are pulled out from
-// one bitplane at a time. The order in which the chunks are pulled out in each bitplane is
-// randomized using a reproducible random number generator with a fixed seed. For images in which
-// the width or height is not divisible by 8, the excess pixels on the right side or bottom are
-// simply skipped over, so there is no problem in handling images of any size.
+// The bitplanes of a stego image, read one chunk at a time straight from the image, for
+// extracting small messages from large images
 //
-// This requires a lot of intricate work shuffling around bits. But this process is greatly
-// simplified by the get_bit(...) and set_bit(...) functions, which essentially treat an array of
-// bytes as an array of bits. This makes the process of copying bits about as simple as it is to
-// copy bytes.
-DataChunkArray chunkify(Image const& img) {
-    DataChunkArray chunk_data;
-    auto init_op = [&](size_t chunks_per_bitplane) -> u8* {
-        // Allocate space for all 32 bitplanes of chunk data
-        chunk_data.chunks.resize(chunks_per_bitplane * 32);
-        return chunk_data.bytes_begin();
-    };
-
-    auto transfer_op = [](u8 const* pixel_data_ptr, size_t pixel_data_bit_index,
-        u8* chunk_data_ptr, size_t chunk_data_bit_index)
-    {
-        // transfer one bit from the pixel data to the chunk data
-        auto bit_value = get_bit(pixel_data_ptr, pixel_data_bit_index);
-        set_bit(chunk_data_ptr, chunk_data_bit_index, bit_value);
-    };
+// This has the same view(...) as BitplaneImage, but instead of splitting up the whole image first,
+// each chunk is sliced out of its block when it is read. The blocks are looked up with
+// chunk_priority_range(...), a window of positions at a time.
+struct LazyBitplaneView {
+    Image const* img;
+    std::vector<u32> const* shuffle;
+    size_t bitplane_index;
+    size_t size;
+
+    mutable size_t window_begin = 0;
+    mutable size_t window_size = 0;
+    mutable u32 window[64] = {};
+    mutable size_t cached_ci = SIZE_MAX;
+    mutable DataChunk cached_chunk = {};
+
+    size_t block_index(size_t ci) const {
+        if (ci < window_begin || ci >= window_begin + window_size) {
+            window_begin = ci / std::size(window) * std::size(window);
+            window_size = std::min(std::size(window), size - window_begin);
+            chunk_priority_range(*shuffle, bitplane_index, window_begin, window_size, window);
+        }
+        return window[ci - window_begin];
+    }
 
-    // init_op and transfer_op are callback functions, which are called in chunkify_common. So no
-    // work has actually been done so far in this function until we call chunkify_common
-    chunkify_common(img, init_op, transfer_op);
+    // the offset in the pixel data of the block holding chunk <ci>
+    size_t block_offset(size_t ci) const {
+        size_t chunks_in_width = img->width / 8;
+        size_t block = block_index(ci);
+        size_t x = block % chunks_in_width;
+        size_t y = block / chunks_in_width;
+        return y * 8 * img->width * 4 + x * 8 * 4;
+    }
 
-    return chunk_data;
-}
+    DataChunk const& operator[](size_t ci) const {
+        if (ci == cached_ci)
+            return cached_chunk;
 
-// Inserts an array of DataChunks back into an image.
-//
-// Simply reverses the process of chunkify(...), breaking the chunks apart into their component bits
-// and placing the bits them back into the appropriate place in the image. The same random number
-// generator with the same seed is used as was used in chunkify(...).
-//
-// The structure of the loops is identical to that of chunkify(...), with the only difference being
-// which array we call get_bit(...) and set_bit(...) on.
-void de_chunkify(Image& img, DataChunkArray const& chunk_data) {
-    auto init_op = [&](size_t) {
-        // nothing to allocate in this case, just return a pointer to the chunk data
-        return chunk_data.bytes_begin();
-    };
+        size_t row_stride = img->width * 4;
+        auto block_ptr = img->pixel_data.data() + block_offset(ci);
 
-    auto transfer_op = [](u8* pixel_data_ptr, size_t pixel_data_bit_index,
-        u8 const* chunk_data_ptr, size_t chunk_data_bit_index)
-    {
-        // transfer one bit from chunk data to pixel data, the opposite of what chunkify does
-        auto bit_value = get_bit(chunk_data_ptr, chunk_data_bit_index);
-        set_bit(pixel_data_ptr, pixel_data_bit_index, bit_value);
-    };
+        DataChunk sliced[32];
+        best_slice_kernel().slice_block(block_ptr, row_stride, sliced);
+        binary_to_gray_code_chunks(sliced);
 
-    // As with chunkify, init_op and transfer_op are callback functions, which are called in
-    // chunkify_common. So no work has actually been done so far in this function until we call
-    // chunkify_common
-    chunkify_common(img, init_op, transfer_op);
-}
+        cached_ci = ci;
+        cached_chunk = sliced[bitplane_index];
+        return cached_chunk;
+    }
 
-// Hides an already formatted message in a DataChunkArray returned by chunkify(...)
-//
-// Iterate over the chunks in order of bitplane priority (see generate_bitplane_priority(...)),
-// checking their complexity against the threshold, and inserting the chunks from the formatted
-// message at those locations. Note that the first two available chunks are used to store the
-// magic chunks (see generate_magic_chunks(...))
-void hide_formatted_message(HideStats& stats, float threshold,
-    DataChunkArray& cover, DataChunkArray const& formatted_message,
-    u8 rmax, u8 gmax, u8 bmax, u8 amax)
-{
-    auto bitplane_priority = generate_bitplane_priority(rmax, gmax, bmax, amax);
+    u8 transition_count(size_t ci) const { return (*this)[ci].count_transitions(); }
+};
 
-    size_t chunks_per_bitplane = cover.chunks.size() / 32;
-    auto message_chunk_iter = formatted_message.begin();
+struct LazyStegoImage {
+    Image const& img;
+    std::shared_ptr<std::vector<u32> const> shuffle;
 
-    for (size_t bp = 0; bp < bitplane_priority.size(); bp++) {
-        if (message_chunk_iter == formatted_message.end())
-            break;
+    explicit LazyStegoImage(Image const& img)
+        : img(img), shuffle(get_chunk_shuffle(img.width, img.height))
+    {}
 
-        size_t bitplane_index = bitplane_priority[bp];
+    LazyBitplaneView view(size_t bitplane_index) const {
+        return { &img, shuffle.get(), bitplane_index, shuffle->size() };
+    }
+};
 
-        for (size_t ci = 0; ci < chunks_per_bitplane; ci++) {
-            if (message_chunk_iter == formatted_message.end())
-                break;
+// The bitplanes of a cover image, read and written one chunk at a time straight from the image, for
+// hiding small messages in large images
+//
+// Reading works the same as in LazyStegoImage. Replacing a chunk slices its block again, swaps the
+// chunk in, and writes the block straight back, so the other bitplanes of the block, which may have
+// had chunks replaced already, stay as they are.
+struct LazyCoverBitplaneView : LazyBitplaneView {
+    Image* cover;
+
+    void replace(size_t ci, DataChunk const& chunk) const {
+        auto& kernel = best_slice_kernel();
+        size_t row_stride = cover->width * 4;
+        auto block_ptr = cover->pixel_data.data() + block_offset(ci);
+
+        DataChunk sliced[32];
+        kernel.slice_block(block_ptr, row_stride, sliced);
+        binary_to_gray_code_chunks(sliced);
+        sliced[bitplane_index] = chunk;
+        gray_code_to_binary_chunks(sliced);
+        kernel.unslice_block(sliced, block_ptr, row_stride);
+
+        cached_ci = ci;
+        cached_chunk = chunk;
+    }
+};
 
-            size_t chunk_index = bitplane_index * chunks_per_bitplane + ci;
-            auto& cover_chunk = cover.chunks[chunk_index];
+struct LazyCoverImage {
+    Image& img;
+    std::shared_ptr<std::vector<u32> const> shuffle;
 
-            float complexity = cover_chunk.measure_complexity();
-            if (complexity >= threshold) {
-                stats.chunks_used_per_bitplane[bitplane_index]++;
-                stats.chunks_used++;
+    explicit LazyCoverImage(Image& img)
+        : img(img), shuffle(get_chunk_shuffle(img.width, img.height))
+    {}
 
-                cover_chunk = *message_chunk_iter;
-                ++message_chunk_iter;
-            }
-        }
+    LazyCoverBitplaneView view(size_t bitplane_index) const {
+        return { { &img, shuffle.get(), bitplane_index, shuffle->size() }, &img };
     }
-
-    // truncate to multiple of 8, because the extractor can only handle chunks in groups of 8
-    stats.chunks_used = stats.chunks_used / 8 * 8;
-    stats.message_bytes_hidden = stats.chunks_used / 8 * 63 - 23;
+};
+
+// Reads the bitplane limits the message was hidden with from the last byte of each magic chunk,
+// which holds two of them, 4 bits each
+static std::array<u8, 4> read_bitplane_limits(DataChunk const (&magic_chunks)[2]) {
+    return {
+        (u8)((magic_chunks[0].bytes[7] >> 4) & 0xF),
+        (u8)(magic_chunks[0].bytes[7] & 0xF),
+        (u8)((magic_chunks[1].bytes[7] >> 4) & 0xF),
+        (u8)(magic_chunks[1].bytes[7] & 0xF),
+    };
 }
 
-// Extract a hidden formatted message from a DataChunkArray
+// Searches the bitplanes of a stego image for the magic chunks, in the same order the message was
+// hidden in, to find the bitplane limits the message was hidden with
 //
-// Just reverses the process of hide_formatted_message(...)
-DataChunkArray unhide_formatted_message(DataChunkArray const& cover)
+// The magic chunks are near the start of a message, in the least significant bitplanes, so if there
+// is a message, this usually only has to read a few chunks. If more than <max_chunks_read> chunks
+// would have to be read, or the magic chunks aren't there at all, this returns false.
+static bool find_magic_chunks(LazyStegoImage const& stego, size_t max_chunks_read,
+    std::array<u8, 4>& limits)
 {
-    size_t chunks_per_bitplane = cover.chunks.size() / 32;
+    size_t chunks_read = 0;
 
-    // Look for magic chunks to determine which bitplanes were used
     DataChunk magic_chunks[2];
     size_t magic_chunk_index = 0;
     auto bitplane_priority = generate_bitplane_priority(8, 8, 8, 8);
-    for (size_t bp = 0; bp < bitplane_priority.size(); bp++) {
-        if (magic_chunk_index == 2) // if both magic chunks have bee found
-            break;
-
-        size_t bitplane_index = bitplane_priority[bp];
-        for (size_t ci = 0; ci < chunks_per_bitplane; ci++) {
-            if (magic_chunk_index == 2)
-                break;
+    for (size_t bp = 0; bp < bitplane_priority.size() && magic_chunk_index < 2; bp++) {
+        auto bitplane = stego.view(bitplane_priority[bp]);
+        for (size_t ci = 0; ci < bitplane.size && magic_chunk_index < 2; ci++) {
+            if (chunks_read++ >= max_chunks_read)
+                return false;
 
-            size_t chunk_index = bitplane_index * chunks_per_bitplane + ci;
-            auto& cover_chunk = cover.chunks[chunk_index];
+            auto& cover_chunk = bitplane[ci];
             if (is_magic(cover_chunk, magic_chunk_index)) {
                 magic_chunks[magic_chunk_index++] = cover_chunk;
             }
         }
     }
 
-    if (magic_chunk_index != 2) {
-        auto err = "magic number not found";
-        throw std::runtime_error(err);
+    if (magic_chunk_index != 2)
+        return false;
+
+    limits = read_bitplane_limits(magic_chunks);
+    return true;
+}
+
+// Searches a whole image for the magic chunks, like find_magic_chunks(...) above, but without
+// reading the bitplanes in order
+//
+// Like alter_magic_chunks(...), this goes through the image block by block, so it doesn't need to
+// store the bitplanes, and can check all 32 chunks of a block at once (see find_magic_chunk(...)).
+// Hardly any chunks match, so the few that do are collected, and then put in the order in which
+// they would have been read. A chunk's position in its bitplane's order is found by undoing the
+// chunk shuffle (see chunk_priority_range(...)).
+//
+// Most images which get searched don't have a message hidden in them, and this is the quickest way
+// of finding that out for sure.
+bool find_magic_chunks(Image const& img, std::array<u8, 4>& limits) {
+    struct Candidate {
+        size_t bitplane_index;
+        size_t block_index;
+        DataChunk chunk;
+    };
+
+    std::vector<Candidate> candidates;
+    std::mutex candidates_mutex;
+
+    size_t row_stride = img.width * 4;
+    size_t chunks_in_width = img.width / 8;
+    auto& kernel = best_slice_kernel();
+
+    parallel_for(img.height / 8, [&](size_t y_begin, size_t y_end) {
+        for (size_t y = y_begin * 8; y < y_end * 8; y += 8) {
+            for (size_t x = 0; x + 8 <= img.width; x += 8) {
+                auto block_ptr = img.pixel_data.data() + y * row_stride + x * 4;
+
+                DataChunk chunks[32];
+                kernel.slice_block(block_ptr, row_stride, chunks);
+                binary_to_gray_code_chunks(chunks);
+
+                size_t i = find_magic_chunk(chunks, 32);
+                while (i < 32) {
+                    std::lock_guard lock(candidates_mutex);
+                    candidates.push_back({ i, y / 8 * chunks_in_width + x / 8, chunks[i] });
+                    i += 1 + find_magic_chunk(chunks + i + 1, 32 - i - 1);
+                }
+            }
+        }
+    });
+
+    if (candidates.empty())
+        return false;
+
+    auto shuffle = get_chunk_shuffle(img.width, img.height);
+    std::vector<u32> unshuffle(shuffle->size());
+    for (size_t i = 0; i < shuffle->size(); i++)
+        unshuffle[(*shuffle)[i]] = (u32)i;
+
+    auto bitplane_priority = generate_bitplane_priority(8, 8, 8, 8);
+    std::array<size_t, 32> bitplane_rank;
+    for (size_t bp = 0; bp < bitplane_priority.size(); bp++)
+        bitplane_rank[bitplane_priority[bp]] = bp;
+
+    // the order in which find_magic_chunks(...) would have come across the candidates
+    std::vector<std::pair<size_t, size_t>> read_order;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        size_t position = candidates[i].block_index;
+        for (size_t n = 0; n <= candidates[i].bitplane_index; n++)
+            position = unshuffle[position];
+        size_t rank = bitplane_rank[candidates[i].bitplane_index];
+        read_order.push_back({ rank * shuffle->size() + position, i });
     }
+    std::sort(read_order.begin(), read_order.end());
 
-    // The last byte of each magic chunk contains the bitplanes used per color channel
-    u8 rmax = (magic_chunks[0].bytes[7] >> 4) & 0xF;
-    u8 gmax = magic_chunks[0].bytes[7] & 0xF;
-    u8 bmax = (magic_chunks[1].bytes[7] >> 4) & 0xF;
-    u8 amax = magic_chunks[1].bytes[7] & 0xF;
+    DataChunk magic_chunks[2];
+    size_t magic_chunk_index = 0;
+    for (auto& [order, i] : read_order) {
+        if (magic_chunk_index < 2 && is_magic(candidates[i].chunk, magic_chunk_index))
+            magic_chunks[magic_chunk_index++] = candidates[i].chunk;
+    }
 
-    bitplane_priority = generate_bitplane_priority(rmax, gmax, bmax, amax);
+    if (magic_chunk_index != 2)
+        return false;
 
-    DataChunkArray formatted_message;
+    limits = read_bitplane_limits(magic_chunks);
+    return true;
+}
+
+// Finds the bitplane limits a message was hidden with, or returns false if there is no message
+//
+// Small images, and images with a message, are searched one chunk at a time. Otherwise, the search
+// moves on to the whole image at once, without reading through the bitplanes one after another.
+static bool find_bitplane_limits(Image const& img, LazyStegoImage const& lazy_stego,
+    std::array<u8, 4>& limits)
+{
+    size_t const max_magic_chunks_read = 4096;
+    if (find_magic_chunks(lazy_stego, max_magic_chunks_read, limits))
+        return true;
+    return find_magic_chunks(img, limits);
+}
+
+// Extract a hidden formatted message from the bitplanes of a stego image, unformatting it as it
+// goes
+//
+// Just reverses the process of hide_formatted_message(...). <stego> is either a BitplaneImage
+// holding the bitplanes given by <limits>, or a LazyStegoImage. Each message chunk is passed to
+// <message> as soon as it is found.
+//
+// If <check_magic_chunks> is set, the 2nd and 3rd chunks of the message, which is where
+// format_message(...) put them, are checked to be the magic chunks for <limits>. This is for when
+// the limits were given, rather than read from the magic chunks.
+//
+// The size of the message is in the first chunk, so once that has been read, the scan stops as soon
+// as the rest of the formatted message has been collected, instead of running through every chunk
+// of every bitplane. If more than <max_chunks_read> chunks would have to be read, this gives up and
+// returns false, so that the caller can switch to a faster way of reading chunks in bulk. Calling
+// this again with the same <message> then carries on from the chunks which have already been added.
+template<typename StegoImage>
+static bool unhide_formatted_message(StegoImage const& stego, std::array<u8, 4> const& limits,
+    bool check_magic_chunks, size_t max_chunks_read, MessageUnformatter& message)
+{
+    size_t chunks_read = 0;
+    auto bitplane_priority = generate_bitplane_priority(limits[0], limits[1], limits[2], limits[3]);
+
+    // The size chunk is parsed once it has been read, or if the magic chunks are being checked,
+    // once they have been read too
+    size_t header_chunk_count = check_magic_chunks ? 3 : 1;
+
+    // the index in the formatted message of the next message chunk found
+    size_t chunk_index = 0;
 
     for (size_t bp = 0; bp < bitplane_priority.size(); bp++) {
-        size_t bitplane_index = bitplane_priority[bp];
+        auto bitplane = stego.view(bitplane_priority[bp]);
+        for (size_t ci = 0; ci < bitplane.size; ci++) {
+            if (message.complete())
+                return true;
+            if (chunks_read++ >= max_chunks_read)
+                return false;
 
-        for (size_t ci = 0; ci < chunks_per_bitplane; ci++) {
-            size_t chunk_index = bitplane_index * chunks_per_bitplane + ci;
-            auto& cover_chunk = cover.chunks[chunk_index];
-            auto complexity = cover_chunk.measure_complexity();
             // When extracting, we don't have to care about the specific threshold that was used in
             // hiding, because the hiding algorithm just conjugates all message chunks with
             // complexity < 0.5, changing them to be >= 0.5
-            if (complexity >= 0.5) {
-                formatted_message.chunks.push_back(cover_chunk);
+            if (bitplane.transition_count(ci) < MESSAGE_MIN_TRANSITIONS)
+                continue;
+
+            // an earlier call which gave up part way through may have added this chunk already
+            if (chunk_index++ < message.chunk_count)
+                continue;
+
+            message.add_chunk(bitplane[ci]);
+            if (message.chunk_count != header_chunk_count)
+                continue;
+
+            if (check_magic_chunks) {
+                auto magic_chunks =
+                    generate_magic_chunks(limits[0], limits[1], limits[2], limits[3]);
+                if (message.group[1] != magic_chunks[0] || message.group[2] != magic_chunks[1]) {
+                    auto err = "magic number not found";
+                    throw std::runtime_error(err);
+                }
             }
+
+            // every chunk of the message takes at least one read, so give up now if they can't
+            // all be read
+            size_t formatted_chunk_count = message.read_size();
+            if (formatted_chunk_count - header_chunk_count > max_chunks_read - chunks_read)
+                return false;
         }
     }
 
-    return formatted_message;
+    if (check_magic_chunks && message.chunk_count < header_chunk_count) {
+        auto err = "magic number not found";
+        throw std::runtime_error(err);
+    }
+
+    return true;
 }
 
 // Alters any existing magic chunks
@@ -376,97 +499,642 @@ DataChunkArray unhide_formatted_message(DataChunkArray const& cover)
 // original magic chunks will occur before the new magic chunks that we insert. This will cause an
 // issue on extracting, because the extraction algorithm will be reading the wrong magic chunks for
 // determining the rmax, gmax, bmax and amax values. This function eliminates that possibility.
-void alter_magic_chunks(DataChunkArray& chunk_data) {
-    for (auto& chunk : chunk_data) {
-        if (is_magic(chunk, 0) || is_magic(chunk, 1)) {
-            chunk.bytes[0] ^= 0x80; // flip the first bit of the first byte
+//
+// The extraction algorithm searches every bitplane for the magic chunks, not just the ones we are
+// going to hide in, so this works directly on the image to cover all 32 bitplanes. Like
+// BitplaneImage::from_image(...), it looks at the gray coded chunks.
+//
+// Every chunk passes through here anyway, so this also returns the transition histograms of
+// <counted_bitplanes>, as they are after altering, the same as count_transition_histograms(...).
+std::array<TransitionHistogram, 32> alter_magic_chunks(Image& img,
+    std::vector<size_t> const& counted_bitplanes = {},
+    SliceKernel const& kernel = best_slice_kernel())
+{
+    size_t row_stride = img.width * 4;
+    auto& transition_kernel = best_transition_kernel();
+
+    std::array<TransitionHistogram, 32> histograms = {};
+    std::mutex histograms_mutex;
+
+    parallel_for(img.height / 8, [&](size_t y_begin, size_t y_end) {
+        std::array<TransitionHistogram, 32> band_histograms = {};
+
+        for (size_t y = y_begin * 8; y < y_end * 8; y += 8) {
+            for (size_t x = 0; x + 8 <= img.width; x += 8) {
+                auto block_ptr = img.pixel_data.data() + y * row_stride + x * 4;
+
+                DataChunk chunks[32];
+                kernel.slice_block(block_ptr, row_stride, chunks);
+                binary_to_gray_code_chunks(chunks);
+
+                // almost every block has no magic chunks, so check them all at once first
+                if (find_magic_chunk(chunks, 32) != 32) {
+                    bool altered = false;
+                    for (auto& chunk : chunks) {
+                        if (is_magic(chunk, 0) || is_magic(chunk, 1)) {
+                            chunk.bytes[0] ^= 0x80; // flip the first bit of the first byte
+                            altered = true;
+                        }
+                    }
+
+                    // the gray coded chunks are still needed for counting transitions
+                    if (altered) {
+                        DataChunk altered_chunks[32];
+                        std::copy(std::begin(chunks), std::end(chunks), altered_chunks);
+                        gray_code_to_binary_chunks(altered_chunks);
+                        kernel.unslice_block(altered_chunks, block_ptr, row_stride);
+                    }
+                }
+
+                if (counted_bitplanes.empty())
+                    continue;
+
+                u8 transitions[32];
+                transition_kernel.count_transitions(chunks, 32, transitions);
+                for (size_t bitplane_index : counted_bitplanes)
+                    band_histograms[bitplane_index][transitions[bitplane_index]]++;
+            }
+        }
+
+        if (counted_bitplanes.empty())
+            return;
+
+        std::lock_guard<std::mutex> lock(histograms_mutex);
+        for (size_t bitplane_index : counted_bitplanes) {
+            for (size_t count = 0; count <= MAX_TRANSITIONS; count++)
+                histograms[bitplane_index][count] += band_histograms[bitplane_index][count];
+        }
+    });
+
+    return histograms;
+}
+
+// at_least[bitplane_index][t] is the number of chunks in that bitplane with t or more transitions.
+// Only thresholds up to 0.5 are ever used for hiding, so t stops at MESSAGE_MIN_TRANSITIONS.
+using ChunksAtLeast = std::array<std::array<size_t, MESSAGE_MIN_TRANSITIONS + 1>, 32>;
+
+static ChunksAtLeast count_chunks_at_least(std::array<TransitionHistogram, 32> const& histograms) {
+    ChunksAtLeast at_least;
+    for (size_t bitplane_index = 0; bitplane_index < 32; bitplane_index++) {
+        size_t cumulative = 0;
+        for (size_t count = MAX_TRANSITIONS + 1; count-- > 0;) {
+            cumulative += histograms[bitplane_index][count];
+            if (count <= MESSAGE_MIN_TRANSITIONS)
+                at_least[bitplane_index][count] = cumulative;
         }
     }
+    return at_least;
 }
 
-// Hides a message in an image
+// The threshold calculate_max_threshold(...) would pick for <chunk_count> chunks, from the
+// histograms of the bitplanes instead of a BitplaneImage
+static float calculate_max_threshold(size_t chunk_count,
+    std::array<TransitionHistogram, 32> const& histograms,
+    std::vector<size_t> const& bitplane_priority)
+{
+    auto at_least = count_chunks_at_least(histograms);
+    for (size_t count = MESSAGE_MIN_TRANSITIONS + 1; count-- > 0;) {
+        size_t total = 0;
+        for (size_t bitplane_index : bitplane_priority)
+            total += at_least[bitplane_index][count];
+        if (total >= chunk_count)
+            return (float)count / (float)MAX_TRANSITIONS;
+    }
+    return 0.0f;
+}
+
+// Estimates how many chunks hide_formatted_message(...) will go through to hide <chunk_count>
+// chunks at <threshold>, from the histograms of the bitplanes
 //
-// This is the high level function that ties everything together for the hiding algorithm.
-HideStats bpcs_hide(float threshold, Image& img, std::vector<u8> const& message,
-    u8 rmax, u8 gmax, u8 bmax, u8 amax)
+// The bitplanes are gone through in priority order, and the complex chunks of each are spread
+// evenly through it by the chunk shuffle, so only the last bitplane needs estimating.
+static size_t estimate_chunks_read(size_t chunk_count, float threshold,
+    std::array<TransitionHistogram, 32> const& histograms,
+    std::vector<size_t> const& bitplane_priority)
+{
+    u8 min_transitions = threshold_to_transitions(threshold);
+    size_t chunks_read = 0;
+    for (size_t bitplane_index : bitplane_priority) {
+        size_t size = 0;
+        size_t usable = 0;
+        for (size_t count = 0; count <= MAX_TRANSITIONS; count++) {
+            size += histograms[bitplane_index][count];
+            if (count >= min_transitions)
+                usable += histograms[bitplane_index][count];
+        }
+
+        if (chunk_count <= usable)
+            return chunks_read + (chunk_count * size + usable - 1) / std::max<size_t>(usable, 1);
+        chunks_read += size;
+        chunk_count -= usable;
+    }
+    return chunks_read;
+}
+
+// The part of bpcs_hide(...) which comes after alter_magic_chunks(...)
+//
+// A small message only takes up a few chunks, so it is hidden one chunk at a time straight in the
+// image (see LazyCoverImage), and only the blocks it lands in are ever sliced. If that has to go
+// through more than <max_lazy_chunks_read> chunks, splitting up the bitplanes at once is cheaper,
+// so it carries on with a BitplaneImage, like extract(...) does. A dynamic threshold (negative
+// <threshold>) depends on every chunk, so it is only worked out here when there is a BitplaneImage
+// to do it with. Otherwise, everything goes straight to the BitplaneImage.
+static HideStats hide_in_altered_image(float threshold, Image& img,
+    std::span<u8 const> message, u8 rmax, u8 gmax, u8 bmax, u8 amax, size_t max_lazy_chunks_read)
 {
     HideStats stats = {};
     stats.message_size = message.size();
     stats.chunks_per_bitplane = (img.width / 8) * (img.height / 8);
 
-    auto formatted_data = format_message(message, rmax, gmax, bmax, amax);
+    MessageFormatter formatter(message, rmax, gmax, bmax, amax);
+    auto bitplane_priority = generate_bitplane_priority(rmax, gmax, bmax, amax);
 
-    binary_to_gray_code_inplace(img.pixel_data);
-    auto chunk_data = chunkify(img);
-    alter_magic_chunks(chunk_data);
+    std::vector<u8> replaced_blocks(stats.chunks_per_bitplane);
+    size_t chunks_read = 0;
+    bool done = false;
 
-    // The calling function can pass a negative value in order to have the threshold determined
-    // dynamically.
-    if (threshold < 0.0f) {
-        auto bitplane_priority = generate_bitplane_priority(rmax, gmax, bmax, amax);
-        threshold = calculate_max_threshold(formatted_data.chunks.size(), chunk_data,
-            bitplane_priority);
+    // every chunk of the message takes at least one read
+    if (threshold >= 0.0f && formatter.formatted_chunk_count <= max_lazy_chunks_read) {
+        LazyCoverImage lazy_cover(img);
+        done = hide_formatted_message(stats, threshold, lazy_cover, formatter, replaced_blocks,
+            bitplane_priority, chunks_read, max_lazy_chunks_read);
+
+        // the blocks replaced so far have already been written
+        std::fill(replaced_blocks.begin(), replaced_blocks.end(), 0);
+    }
+
+    if (!done) {
+        auto cover = BitplaneImage::from_image(img, bitplane_priority);
+
+        // The calling function can pass a negative value in order to have the threshold
+        // determined dynamically.
+        if (threshold < 0.0f) {
+            threshold = calculate_max_threshold(formatter.formatted_chunk_count, cover,
+                bitplane_priority);
+        }
+
+        hide_formatted_message(stats, threshold, cover, formatter, replaced_blocks,
+            bitplane_priority, chunks_read, SIZE_MAX);
+
+        // Only the blocks which had chunks replaced need to be written back
+        std::vector<size_t> replaced_block_indices;
+        for (size_t i = 0; i < replaced_blocks.size(); i++) {
+            if (replaced_blocks[i])
+                replaced_block_indices.push_back(i);
+        }
+        cover.blocks_to_image(img, replaced_block_indices);
     }
 
     stats.threshold = threshold;
-    hide_formatted_message(stats, threshold, chunk_data, formatted_data,
-        rmax, gmax, bmax, amax);
-    stats.message_bytes_hidden = std::min(stats.message_bytes_hidden, message.size());
 
-    de_chunkify(img, chunk_data);
-    gray_code_to_binary_inplace(img.pixel_data);
+    // truncate to multiple of 8, because the extractor can only handle chunks in groups of 8
+    stats.chunks_used = stats.chunks_used / 8 * 8;
+    stats.message_bytes_hidden = calculate_message_capacity_from_chunk_count(stats.chunks_used);
+    stats.message_bytes_hidden = std::min(stats.message_bytes_hidden, message.size());
 
     return stats;
 }
 
-// Extracts a message hidden in an image
+// Decides how many chunks hide_in_altered_image(...) should go through one at a time, given the
+// histograms of the bitplanes being hidden in, and works out a dynamic threshold from them
 //
-// The high level function that ties everything together for the extracting algorithm.
-std::vector<u8> bpcs_extract(Image& img) {
-    binary_to_gray_code_inplace(img.pixel_data);
-    auto chunk_data = chunkify(img);
-    auto formatted_data = unhide_formatted_message(chunk_data);
-    auto message = unformat_message(formatted_data);
+// Going through a chunk on its own costs about as much as slicing a whole block, while a
+// BitplaneImage slices every block once, so the message is only hidden one chunk at a time if it
+// is expected to take fewer than LAZY_HIDE_MAX_BLOCK_FRACTION of the blocks' worth of reads. The
+// limit is kept at that, in case the estimate is off.
+static size_t plan_lazy_hide(float& threshold, size_t chunk_count, size_t chunks_per_bitplane,
+    std::array<TransitionHistogram, 32> const& histograms,
+    std::vector<size_t> const& bitplane_priority)
+{
+    if (threshold < 0.0f)
+        threshold = calculate_max_threshold(chunk_count, histograms, bitplane_priority);
+
+    size_t max_chunks_read = chunks_per_bitplane / LAZY_HIDE_MAX_BLOCK_FRACTION;
+    if (estimate_chunks_read(chunk_count, threshold, histograms, bitplane_priority)
+        > max_chunks_read)
+    {
+        return 0;
+    }
+    return max_chunks_read;
+}
+
+// Hides a message in an image
+//
+// This is the high level function that ties everything together for the hiding algorithm.
+//
+// Unless the message is too big to be hidden one chunk at a time anyway, the histograms of the
+// bitplanes are counted while altering the magic chunks, to decide whether to (see
+// plan_lazy_hide(...)).
+HideStats bpcs_hide(float threshold, Image& img, std::span<u8 const> message,
+    u8 rmax, u8 gmax, u8 bmax, u8 amax)
+{
+    size_t chunks_per_bitplane = (img.width / 8) * (img.height / 8);
+    size_t chunk_count = calculate_formatted_message_size(message.size()) / 8;
+    if (chunk_count > chunks_per_bitplane / LAZY_HIDE_MAX_BLOCK_FRACTION) {
+        alter_magic_chunks(img);
+        return hide_in_altered_image(threshold, img, message, rmax, gmax, bmax, amax, 0);
+    }
+
+    auto bitplane_priority = generate_bitplane_priority(rmax, gmax, bmax, amax);
+    auto histograms = alter_magic_chunks(img, bitplane_priority);
+    size_t max_lazy_chunks_read = plan_lazy_hide(threshold, chunk_count, chunks_per_bitplane,
+        histograms, bitplane_priority);
+    return hide_in_altered_image(threshold, img, message, rmax, gmax, bmax, amax,
+        max_lazy_chunks_read);
+}
+
+// Hides a message in an image, choosing the bitplane limits with choose_bitplanes(...)
+//
+// The threshold works the same as in bpcs_hide(...). A negative value has it determined
+// dynamically, for whichever bitplane limits are chosen. The histograms are counted while altering
+// the magic chunks.
+HideStats bpcs_hide_auto_planes(float threshold, Image& img, std::span<u8 const> message) {
+    auto histograms = alter_magic_chunks(img, generate_bitplane_priority(8, 8, 8, 8));
+
+    // the formatted size doesn't depend on the limits
+    size_t chunk_count = calculate_formatted_message_size(message.size()) / 8;
+    auto choice = choose_bitplanes(histograms, chunk_count, threshold);
+
+    size_t chunks_per_bitplane = (img.width / 8) * (img.height / 8);
+    auto bitplane_priority =
+        generate_bitplane_priority(choice.rmax, choice.gmax, choice.bmax, choice.amax);
+    size_t max_lazy_chunks_read = plan_lazy_hide(choice.threshold, chunk_count,
+        chunks_per_bitplane, histograms, bitplane_priority);
+    return hide_in_altered_image(choice.threshold, img, message,
+        choice.rmax, choice.gmax, choice.bmax, choice.amax, max_lazy_chunks_read);
+}
+
+// Extracts a message hidden in an image, with the given bitplane limits, or with the limits read
+// from the magic chunks if <known_limits> is null, passing it to <sink> as it is extracted
+//
+// A small message only takes up a few chunks, so first the chunks are read one at a time straight
+// from the image (see LazyStegoImage). If that has to read more than a bitplane's worth of chunks,
+// splitting up the bitplanes which hold the message at once is cheaper, so it carries on with a
+// BitplaneImage.
+static size_t extract(Image const& img, std::array<u8, 4> const* known_limits,
+    MessageSink const& sink)
+{
+    size_t chunks_per_bitplane = (img.width / 8) * (img.height / 8);
+    LazyStegoImage lazy_stego(img);
+
+    std::array<u8, 4> limits;
+    if (known_limits) {
+        limits = *known_limits;
+    } else if (!find_bitplane_limits(img, lazy_stego, limits)) {
+        auto err = "magic number not found";
+        throw std::runtime_error(err);
+    }
+
+    MessageUnformatter message(sink);
+    bool check_magic_chunks = known_limits != nullptr;
+    if (!unhide_formatted_message(lazy_stego, limits, check_magic_chunks, chunks_per_bitplane,
+        message))
+    {
+        auto bitplane_priority =
+            generate_bitplane_priority(limits[0], limits[1], limits[2], limits[3]);
+        auto stego = BitplaneImage::from_image(img, bitplane_priority);
+        unhide_formatted_message(stego, limits, check_magic_chunks, SIZE_MAX, message);
+    }
+
+    return message.bytes_written;
+}
+
+// Extracts a message hidden in an image, passing it to <sink> a piece at a time, and returns its
+// size
+//
+// The high level function that ties everything together for the extracting algorithm. The message
+// is never stored as a whole, only one group of 8 chunks at a time (see MessageUnformatter).
+size_t bpcs_extract(Image const& img, MessageSink const& sink) {
+    return extract(img, nullptr, sink);
+}
+
+// Extracts a message which was hidden in an image with the given bitplane limits
+//
+// Instead of searching every bitplane for the magic chunks, this only checks that they are where
+// they would be with these limits, and fails if they aren't.
+size_t bpcs_extract(Image const& img, u8 rmax, u8 gmax, u8 bmax, u8 amax,
+    MessageSink const& sink)
+{
+    std::array<u8, 4> known_limits = { rmax, gmax, bmax, amax };
+    return extract(img, &known_limits, sink);
+}
+
+// Extracts a message hidden in an image, returning it as a whole
+std::vector<u8> bpcs_extract(Image const& img) {
+    std::vector<u8> message;
+    bpcs_extract(img, [&](u8 const* data, size_t size) {
+        message.insert(message.end(), data, data + size);
+    });
+    return message;
+}
+
+std::vector<u8> bpcs_extract(Image const& img, u8 rmax, u8 gmax, u8 bmax, u8 amax) {
+    std::vector<u8> message;
+    bpcs_extract(img, rmax, gmax, bmax, amax, [&](u8 const* data, size_t size) {
+        message.insert(message.end(), data, data + size);
+    });
     return message;
 }
 
+// Finds the first chunk of a message, which holds its size, in the bitplanes given by <limits>
+//
+// Like unhide_formatted_message(...), this gives up and returns false if more than
+// <max_chunks_read> chunks would have to be read. It also returns false if there are no message
+// chunks at all.
+template<typename StegoImage>
+static bool find_size_chunk(StegoImage const& stego, std::array<u8, 4> const& limits,
+    size_t max_chunks_read, DataChunk& size_chunk)
+{
+    size_t chunks_read = 0;
+    auto bitplane_priority = generate_bitplane_priority(limits[0], limits[1], limits[2], limits[3]);
+    for (size_t bp = 0; bp < bitplane_priority.size(); bp++) {
+        auto bitplane = stego.view(bitplane_priority[bp]);
+        for (size_t ci = 0; ci < bitplane.size; ci++) {
+            if (chunks_read++ >= max_chunks_read)
+                return false;
+            if (bitplane.transition_count(ci) >= MESSAGE_MIN_TRANSITIONS) {
+                size_chunk = bitplane[ci];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Checks whether there is a message hidden in an image, and if so, what bitplane limits it was
+// hidden with and how big it is, without extracting it
+//
+// Only the magic chunks and the size chunk are read, the same way extract(...) reads them, so this
+// stops as soon as it has an answer, and only ever splits up the bitplanes which hold the message.
+ProbeResult bpcs_probe(Image const& img) {
+    ProbeResult result = {};
+    size_t chunks_per_bitplane = (img.width / 8) * (img.height / 8);
+    LazyStegoImage lazy_stego(img);
+
+    std::array<u8, 4> limits;
+    if (!find_bitplane_limits(img, lazy_stego, limits))
+        return result;
+
+    result.rmax = limits[0];
+    result.gmax = limits[1];
+    result.bmax = limits[2];
+    result.amax = limits[3];
+
+    // Probing is for finding out what's in an image, so a damaged message is an answer, not an
+    // error. The header is corrupt if there's no size chunk in the bitplanes the magic chunks name,
+    // or if it doesn't have the signature.
+    DataChunk size_chunk;
+    if (!find_size_chunk(lazy_stego, limits, chunks_per_bitplane, size_chunk)) {
+        auto bitplane_priority =
+            generate_bitplane_priority(limits[0], limits[1], limits[2], limits[3]);
+        auto stego = BitplaneImage::from_image(img, bitplane_priority);
+        if (!find_size_chunk(stego, limits, SIZE_MAX, size_chunk)) {
+            result.corrupt_header = true;
+            return result;
+        }
+    }
+
+    try {
+        result.message_size = parse_size_chunk(size_chunk);
+        result.found = true;
+    } catch (std::runtime_error const&) {
+        result.corrupt_header = true;
+    }
+    return result;
+}
+
+// Counts how many chunks of each of the given bitplanes have each possible number of bit
+// transitions. histograms[bitplane_index][count] is the number of chunks in that bitplane with
+// <count> transitions. Bitplanes which aren't in <bitplanes> are left at zero.
+//
+// Like alter_magic_chunks(...), this works straight from the image, one block at a time, so nothing
+// is stored but the histograms. Each thread fills in its own histograms, which are added up at the
+// end.
+std::array<TransitionHistogram, 32> count_transition_histograms(Image const& img,
+    std::vector<size_t> const& bitplanes, SliceKernel const& kernel)
+{
+    size_t row_stride = img.width * 4;
+    auto& transition_kernel = best_transition_kernel();
+
+    std::array<TransitionHistogram, 32> histograms = {};
+    std::mutex histograms_mutex;
+
+    parallel_for(img.height / 8, [&](size_t y_begin, size_t y_end) {
+        std::array<TransitionHistogram, 32> band_histograms = {};
+
+        for (size_t y = y_begin * 8; y < y_end * 8; y += 8) {
+            for (size_t x = 0; x + 8 <= img.width; x += 8) {
+                auto block_ptr = img.pixel_data.data() + y * row_stride + x * 4;
+
+                DataChunk chunks[32];
+                kernel.slice_block(block_ptr, row_stride, chunks);
+                binary_to_gray_code_chunks(chunks);
+
+                u8 transitions[32];
+                transition_kernel.count_transitions(chunks, 32, transitions);
+                for (size_t bitplane_index : bitplanes)
+                    band_histograms[bitplane_index][transitions[bitplane_index]]++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(histograms_mutex);
+        for (size_t bitplane_index : bitplanes) {
+            for (size_t count = 0; count <= MAX_TRANSITIONS; count++)
+                histograms[bitplane_index][count] += band_histograms[bitplane_index][count];
+        }
+    });
+
+    return histograms;
+}
+
 // Given an image and a complexity threshold, determines the image's hiding capacity at that
 // threshold.
 //
-// Simply makes a message that definitely won't fit, and tries to hide it. The hide function will
-// report how many bytes were actually hidden. Probably not the most efficient way to do this,
-// but it works, and re-uses the code I already have.
-HideStats bpcs_measure(float threshold, Image& img, u8 rmax, u8 gmax, u8 bmax, u8 amax) {
-    std::vector<u8> message(img.pixel_data.size());
-    return bpcs_hide(threshold, img, message, rmax, gmax, bmax, amax);
-}
+// This gives the same numbers that bpcs_hide(...) would report for a message too large to fit, but
+// without making one, or touching the image. Hiding would use every chunk which meets the
+// threshold in the selected bitplanes, so it is enough to count them, which the histograms of
+// count_transition_histograms(...) do.
+HideStats bpcs_measure(float threshold, Image const& img, u8 rmax, u8 gmax, u8 bmax, u8 amax) {
+    HideStats stats = {};
+    stats.threshold = threshold;
+    stats.chunks_per_bitplane = (img.width / 8) * (img.height / 8);
 
-#ifdef STEG_TEST
+    auto bitplane_priority = generate_bitplane_priority(rmax, gmax, bmax, amax);
+    auto histograms = count_transition_histograms(img, bitplane_priority);
+    u8 min_transitions = threshold_to_transitions(threshold);
 
-#include <gtest/gtest.h>
+    for (size_t bitplane_index : bitplane_priority) {
+        for (size_t count = min_transitions; count <= MAX_TRANSITIONS; count++)
+            stats.chunks_used_per_bitplane[bitplane_index] += histograms[bitplane_index][count];
+        stats.chunks_used += stats.chunks_used_per_bitplane[bitplane_index];
+    }
 
-size_t num_bits_diff(u8 a, u8 b) {
-    return std::popcount((u8)(a ^ b));
+    stats.chunks_used = stats.chunks_used / 8 * 8;
+    stats.message_bytes_hidden = calculate_message_capacity_from_chunk_count(stats.chunks_used);
+    return stats;
 }
 
-TEST(bpcs, gray_code_conversions) {
-    for (int i = 0; i <= 256; i++) {
-        u8 a = (u8)i;
-        u8 b = (u8)(i + 1);
-        u8 ga = binary_to_gray_code(a);
-        u8 gb = binary_to_gray_code(b);
-        size_t diff = num_bits_diff(ga, gb);
-        ASSERT_EQ(diff, 1);
+// Determines the image's hiding capacity for every combination of bitplane limits (0 to 8 for each
+// channel), at every threshold which makes a difference between 0 and 0.5
+//
+// The histograms of all 32 bitplanes are counted once. After that, the number of chunks in a
+// bitplane which meet a threshold is a single lookup, so each entry of the table is just a sum over
+// the bitplanes which generate_bitplane_priority(...) picks for that combination.
+std::vector<CapacityTableRow> bpcs_capacity_table(Image const& img) {
+    auto histograms = count_transition_histograms(img, generate_bitplane_priority(8, 8, 8, 8));
+    auto at_least = count_chunks_at_least(histograms);
+
+    std::vector<CapacityTableRow> table;
+    table.reserve(9 * 9 * 9 * 9);
+    for (u8 rmax = 0; rmax <= 8; rmax++) {
+        for (u8 gmax = 0; gmax <= 8; gmax++) {
+            for (u8 bmax = 0; bmax <= 8; bmax++) {
+                for (u8 amax = 0; amax <= 8; amax++) {
+                    CapacityTableRow row = { rmax, gmax, bmax, amax, {} };
+                    auto bitplanes = generate_bitplane_priority(rmax, gmax, bmax, amax);
+                    for (size_t t = 0; t <= MESSAGE_MIN_TRANSITIONS; t++) {
+                        size_t chunk_count = 0;
+                        for (size_t bitplane_index : bitplanes)
+                            chunk_count += at_least[bitplane_index][t];
+                        row.message_capacity[t] =
+                            calculate_message_capacity_from_chunk_count(chunk_count);
+                    }
+                    table.push_back(row);
+                }
+            }
+        }
     }
 
-    for (int i = 0; i < 256; i++) {
-        u8 a = (u8)i;
-        u8 ga = binary_to_gray_code(a);
-        u8 ba = gray_code_to_binary(ga);
-        ASSERT_EQ(a, ba);
+    return table;
+}
+
+// Chooses the bitplane limits, and the threshold if it isn't given, which disturb the image the
+// least while still fitting <chunk_count> formatted message chunks, given the histograms of all 32
+// bitplanes (see count_transition_histograms(...))
+//
+// Every combination of limits is tried. For each one, the threshold is the highest that fits the
+// message, capped at 0.5, which is the same one that calculate_max_threshold(...) would pick,
+// unless <threshold> is given (not negative). Then the chunks are handed out to the bitplanes in
+// priority order, just like hide_formatted_message(...) does, and each replaced chunk costs 4^s,
+// where s is the significance of its bit (0 for the LSB). That is roughly the squared error it adds
+// to each pixel.
+//
+// The combination with the lowest cost wins, then the one with the fewest bitplanes, then the one
+// with the highest threshold. But replacing simple chunks is what makes hiding visible, and the
+// lower the threshold, the more chunks the least significant bitplanes have to offer, so the
+// threshold has a floor. Only combinations whose threshold is within AUTO_PLANES_THRESHOLD_MARGIN
+// transitions of the highest any combination can reach are considered. Alpha bitplanes are only
+// used if the message doesn't fit in the others at all.
+//
+// If the message doesn't fit anywhere, all bitplanes are used, and hiding stores what it can.
+BitplaneChoice choose_bitplanes(std::array<TransitionHistogram, 32> const& histograms,
+    size_t chunk_count, float threshold)
+{
+    auto at_least = count_chunks_at_least(histograms);
+
+    struct Candidate {
+        BitplaneChoice choice;
+        size_t min_transitions;
+        u64 cost;
+        size_t plane_count;
+    };
+
+    // Finds the threshold and cost of each combination of limits which fits the message, with
+    // <max_amax> alpha bitplanes at most
+    auto find_candidates = [&](u8 max_amax) {
+        std::vector<Candidate> candidates;
+        for (u8 rmax = 0; rmax <= 8; rmax++) {
+            for (u8 gmax = 0; gmax <= 8; gmax++) {
+                for (u8 bmax = 0; bmax <= 8; bmax++) {
+                    for (u8 amax = 0; amax <= max_amax; amax++) {
+                        auto bitplanes = generate_bitplane_priority(rmax, gmax, bmax, amax);
+
+                        auto chunks_at = [&](size_t t) {
+                            size_t total = 0;
+                            for (size_t bitplane_index : bitplanes)
+                                total += at_least[bitplane_index][t];
+                            return total;
+                        };
+
+                        // the number of usable chunks only goes down as the threshold goes up, so
+                        // the highest threshold that fits can be found with a binary search
+                        size_t min_transitions;
+                        if (threshold >= 0.0f) {
+                            min_transitions = threshold_to_transitions(threshold);
+                            if (min_transitions > MESSAGE_MIN_TRANSITIONS
+                                || chunks_at(min_transitions) < chunk_count)
+                            {
+                                continue;
+                            }
+                        } else {
+                            if (chunks_at(0) < chunk_count)
+                                continue;
+                            size_t low = 0;
+                            size_t high = MESSAGE_MIN_TRANSITIONS;
+                            while (low < high) {
+                                size_t mid = (low + high + 1) / 2;
+                                if (chunks_at(mid) >= chunk_count)
+                                    low = mid;
+                                else
+                                    high = mid - 1;
+                            }
+                            min_transitions = low;
+                        }
+
+                        u64 cost = 0;
+                        size_t remaining = chunk_count;
+                        for (size_t bitplane_index : bitplanes) {
+                            size_t available = at_least[bitplane_index][min_transitions];
+                            size_t used = std::min(remaining, available);
+                            size_t significance = 7 - bitplane_index % 8;
+                            cost += (u64)used << (2 * significance);
+                            remaining -= used;
+                        }
+
+                        BitplaneChoice choice = { rmax, gmax, bmax, amax, threshold };
+                        if (threshold < 0.0f)
+                            choice.threshold = (float)min_transitions / (float)MAX_TRANSITIONS;
+                        candidates.push_back({ choice, min_transitions, cost, bitplanes.size() });
+                    }
+                }
+            }
+        }
+        return candidates;
+    };
+
+    auto candidates = find_candidates(0);
+    if (candidates.empty())
+        candidates = find_candidates(8);
+    if (candidates.empty())
+        return { 8, 8, 8, 8, std::max(threshold, 0.0f) };
+
+    size_t best_min_transitions = 0;
+    for (auto& candidate : candidates)
+        best_min_transitions = std::max(best_min_transitions, candidate.min_transitions);
+    size_t threshold_floor = best_min_transitions > AUTO_PLANES_THRESHOLD_MARGIN
+        ? best_min_transitions - AUTO_PLANES_THRESHOLD_MARGIN : 0;
+
+    Candidate const* best = nullptr;
+    for (auto& candidate : candidates) {
+        if (candidate.min_transitions < threshold_floor)
+            continue;
+        auto rank = std::make_tuple(candidate.cost, candidate.plane_count,
+            MAX_TRANSITIONS - candidate.min_transitions);
+        if (best && rank >= std::make_tuple(best->cost, best->plane_count,
+            MAX_TRANSITIONS - best->min_transitions))
+        {
+            continue;
+        }
+        best = &candidate;
     }
+
+    return best->choice;
 }
 
+#ifdef STEG_TEST
+
+#include <gtest/gtest.h>
+
 Image generate_random_image(size_t width, size_t height) {
     std::random_device rd;
     auto seed = rd();
@@ -496,6 +1164,197 @@ Image generate_random_image(size_t width, size_t height) {
     return img;
 }
 
+std::vector<size_t> all_bitplanes() {
+    std::vector<size_t> bitplanes(32);
+    for (size_t i = 0; i < 32; i++)
+        bitplanes[i] = i;
+    return bitplanes;
+}
+
+// The original bit at a time implementation of chunkify(...), kept as a reference for testing the
+// faster implementations against. Always returns all 32 bitplanes, in order, with each bitplane's
+// chunks in the randomized order. Like the original, it converts a copy of the whole image to gray
+// code first.
+DataChunkArray chunkify_reference(Image img) {
+    binary_to_gray_code_inplace(img.pixel_data);
+
+    size_t chunks_in_width = img.width / 8;
+    size_t chunks_per_bitplane = chunks_in_width * (img.height / 8);
+
+    DataChunkArray chunk_data;
+    chunk_data.chunks.resize(chunks_per_bitplane * 32);
+    size_t chunk_data_bit_index = 0;
+
+    auto bitplane_op = [&](size_t bitplane_index, size_t,
+        std::vector<u32> const& chunk_priority)
+    {
+        for (size_t ci = 0; ci < chunks_per_bitplane; ci++) {
+            size_t chunk_x_index = chunk_priority[ci] % chunks_in_width;
+            size_t chunk_y_index = chunk_priority[ci] / chunks_in_width;
+
+            for (size_t row_in_chunk = 0; row_in_chunk < 8; row_in_chunk++) {
+                for (size_t col_in_chunk = 0; col_in_chunk < 8; col_in_chunk++) {
+                    size_t pixel_x = chunk_x_index * 8 + col_in_chunk;
+                    size_t pixel_y = chunk_y_index * 8 + row_in_chunk;
+                    size_t byte_index = (pixel_y * img.width + pixel_x) * 4;
+                    size_t pixel_data_bit_index = byte_index * 8 + bitplane_index;
+                    auto bit_value = get_bit(img.pixel_data.data(), pixel_data_bit_index);
+                    set_bit(chunk_data.bytes_begin(), chunk_data_bit_index, bit_value);
+                    ++chunk_data_bit_index;
+                }
+            }
+        }
+    };
+
+    for_each_chunk_priority(img.width, img.height, all_bitplanes(), bitplane_op);
+
+    return chunk_data;
+}
+
+// Checks that every bitplane held in <planes>, seen through its view, matches the reference
+bool matches_reference(BitplaneImage const& planes, DataChunkArray const& reference) {
+    size_t chunks_per_bitplane = planes.chunks_per_bitplane;
+    if (reference.chunks.size() != chunks_per_bitplane * 32)
+        return false;
+
+    for (size_t bitplane_index : planes.bitplanes) {
+        auto bitplane = planes.view(bitplane_index);
+        auto reference_ptr = reference.chunks.data() + bitplane_index * chunks_per_bitplane;
+        for (size_t ci = 0; ci < bitplane.size; ci++) {
+            if (bitplane[ci] != reference_ptr[ci])
+                return false;
+            if (bitplane.transition_count(ci) != reference_ptr[ci].count_transitions())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+TEST(bpcs, bitplane_image_matches_reference) {
+    size_t const sizes[][2] = { {8, 8}, {64, 48}, {257, 135}, {7, 100} };
+    for (auto& size : sizes) {
+        auto img = generate_random_image(size[0], size[1]);
+        auto planes = BitplaneImage::from_image(img, all_bitplanes());
+        ASSERT_TRUE(matches_reference(planes, chunkify_reference(img)));
+
+        for (auto& chunk : planes.chunks)
+            chunk.conjugate();
+        planes.recount_transitions();
+
+        auto img_altered = img;
+        planes.to_image(img_altered);
+        ASSERT_EQ(BitplaneImage::from_image(img_altered, all_bitplanes()).chunks, planes.chunks);
+        ASSERT_TRUE(matches_reference(planes, chunkify_reference(img_altered)));
+
+        BitplaneImage::from_image(img, all_bitplanes()).to_image(img_altered);
+        ASSERT_EQ(img_altered.pixel_data, img.pixel_data);
+    }
+}
+
+TEST(bpcs, bitplane_image_subset_of_bitplanes) {
+    auto img = generate_random_image(120, 96);
+    auto reference = chunkify_reference(img);
+
+    auto bitplanes = generate_bitplane_priority(3, 0, 5, 1);
+    auto planes = BitplaneImage::from_image(img, bitplanes);
+    ASSERT_EQ(planes.bitplanes, bitplanes);
+    ASSERT_EQ(planes.chunks.size(), bitplanes.size() * planes.chunks_per_bitplane);
+    ASSERT_TRUE(matches_reference(planes, reference));
+
+    // writing back a subset of bitplanes must leave the other bitplanes alone
+    for (auto& chunk : planes.chunks)
+        chunk.conjugate();
+
+    auto img_altered = img;
+    planes.to_image(img_altered);
+    auto altered_reference = chunkify_reference(img_altered);
+    for (size_t bitplane_index = 0; bitplane_index < 32; bitplane_index++) {
+        bool in_use = std::find(bitplanes.begin(), bitplanes.end(), bitplane_index)
+            != bitplanes.end();
+        for (size_t ci = 0; ci < planes.chunks_per_bitplane; ci++) {
+            size_t i = bitplane_index * planes.chunks_per_bitplane + ci;
+            auto expected = reference.chunks[i];
+            if (in_use)
+                expected.conjugate();
+            ASSERT_EQ(altered_reference.chunks[i], expected);
+        }
+    }
+}
+
+TEST(bpcs, bitplane_image_blocks_to_image) {
+    auto img = generate_random_image(200, 120);
+    auto bitplanes = generate_bitplane_priority(6, 6, 6, 6);
+    auto planes = BitplaneImage::from_image(img, bitplanes);
+
+    std::mt19937_64 gen(99);
+    std::vector<size_t> changed_blocks;
+    for (size_t i = 0; i < planes.chunks.size(); i++) {
+        if (gen() % 7 == 0) {
+            planes.chunks[i].conjugate();
+            changed_blocks.push_back(i % planes.chunks_per_bitplane);
+        }
+    }
+
+    std::sort(changed_blocks.begin(), changed_blocks.end());
+    changed_blocks.erase(std::unique(changed_blocks.begin(), changed_blocks.end()),
+        changed_blocks.end());
+
+    auto img_dense = img;
+    planes.to_image(img_dense);
+    auto img_sparse = img;
+    planes.blocks_to_image(img_sparse, changed_blocks);
+    ASSERT_EQ(img_sparse.pixel_data, img_dense.pixel_data);
+}
+
+TEST(bpcs, bitplane_image_multithreaded) {
+    auto original_thread_count = get_thread_count();
+    auto img = generate_random_image(250, 190);
+    auto bitplanes = generate_bitplane_priority(8, 7, 6, 5);
+
+    set_thread_count(1);
+    auto single_threaded = BitplaneImage::from_image(img, bitplanes);
+    auto altered = single_threaded;
+    for (auto& chunk : altered.chunks)
+        chunk.conjugate();
+    altered.recount_transitions();
+    auto img_single_threaded = img;
+    altered.to_image(img_single_threaded);
+
+    for (size_t threads : {2, 3, 8}) {
+        set_thread_count(threads);
+        auto multithreaded = BitplaneImage::from_image(img, bitplanes);
+        ASSERT_EQ(multithreaded.chunks, single_threaded.chunks);
+        ASSERT_EQ(multithreaded.chunk_order, single_threaded.chunk_order);
+
+        auto img_multithreaded = img;
+        altered.to_image(img_multithreaded);
+        ASSERT_EQ(img_multithreaded.pixel_data, img_single_threaded.pixel_data);
+    }
+
+    set_thread_count(original_thread_count);
+}
+
+TEST(bpcs, slice_kernels_match_reference) {
+    auto img = generate_random_image(203, 77);
+    auto reference = chunkify_reference(img);
+
+    auto altered = BitplaneImage::from_image(img, all_bitplanes());
+    for (auto& chunk : altered.chunks)
+        chunk.conjugate();
+    altered.recount_transitions();
+
+    for (auto& kernel : supported_slice_kernels()) {
+        auto planes = BitplaneImage::from_image(img, all_bitplanes(), kernel);
+        ASSERT_TRUE(matches_reference(planes, reference)) << kernel.name;
+
+        auto img_altered = img;
+        altered.to_image(img_altered, kernel);
+        auto altered_reference = chunkify_reference(img_altered);
+        ASSERT_TRUE(matches_reference(altered, altered_reference)) << kernel.name;
+    }
+}
+
 TEST(bpcs, message_hiding) {
     std::random_device rd;
     auto seed = rd();
@@ -510,9 +1369,11 @@ TEST(bpcs, message_hiding) {
     auto img_original = img;
 
     bpcs_hide(-1.0f, img, message, 8, 8, 8, 8);
+    auto img_stego = img;
     auto extracted_message = bpcs_extract(img);
 
     ASSERT_EQ(message, extracted_message);
+    ASSERT_EQ(img.pixel_data, img_stego.pixel_data);
 
     img = img_original;
 
@@ -522,6 +1383,349 @@ TEST(bpcs, message_hiding) {
     ASSERT_EQ(message, extracted_message2);
 }
 
+TEST(bpcs, extract_stops_after_message) {
+    auto img = generate_random_image(320, 256);
+    std::vector<u8> message(300, 0xC3);
+    bpcs_hide(-1.0f, img, message, 2, 2, 2, 2);
+
+    std::vector<u8> extracted;
+    MessageSink sink = [&](u8 const* data, size_t size) {
+        extracted.insert(extracted.end(), data, data + size);
+    };
+
+    // only the formatted message is read, not every complex chunk after it
+    std::array<u8, 4> const limits = { 2, 2, 2, 2 };
+    auto stego = BitplaneImage::from_image(img, generate_bitplane_priority(2, 2, 2, 2));
+    MessageUnformatter formatted(sink);
+    ASSERT_TRUE(unhide_formatted_message(stego, limits, false, SIZE_MAX, formatted));
+    ASSERT_EQ(formatted.chunk_count, calculate_formatted_message_size(message.size()) / 8);
+    ASSERT_EQ(extracted, message);
+
+    // Reading the chunks one at a time gives the same result, unless it runs out of reads. Then
+    // carrying on with the BitplaneImage finishes the message, without repeating any of it.
+    size_t const max_chunk_reads[] = { 10, 800, 1600, SIZE_MAX };
+    for (size_t max_chunks_read : max_chunk_reads) {
+        extracted.clear();
+        MessageUnformatter lazy_formatted(sink);
+        if (!unhide_formatted_message(LazyStegoImage(img), limits, false, max_chunks_read,
+            lazy_formatted))
+        {
+            ASSERT_NE(max_chunks_read, SIZE_MAX);
+            ASSERT_TRUE(unhide_formatted_message(stego, limits, false, SIZE_MAX, lazy_formatted));
+        }
+        ASSERT_EQ(lazy_formatted.chunk_count, formatted.chunk_count);
+        ASSERT_EQ(extracted, message);
+    }
+
+    ASSERT_EQ(bpcs_extract(img), message);
+}
+
+TEST(bpcs, hide_lazy_matches_bitplane_image) {
+    auto img = generate_random_image(320, 256);
+    std::vector<u8> message(400, 0x96);
+    size_t chunk_count = calculate_formatted_message_size(message.size()) / 8;
+    auto bitplane_priority = generate_bitplane_priority(3, 2, 2, 1);
+
+    // Hiding one chunk at a time, all in a BitplaneImage, or switching part way through, all give
+    // the same image. The dynamic threshold from the histograms is the same one a BitplaneImage
+    // gives.
+    for (float threshold : {-1.0f, 0.0f, 0.3f}) {
+        auto altered = img;
+        auto histograms = alter_magic_chunks(altered, bitplane_priority);
+
+        auto expected = altered;
+        auto expected_stats = hide_in_altered_image(threshold, expected, message, 3, 2, 2, 1, 0);
+        ASSERT_EQ(bpcs_extract(expected), message);
+
+        float lazy_threshold = threshold;
+        plan_lazy_hide(lazy_threshold, chunk_count, 1000, histograms, bitplane_priority);
+        ASSERT_EQ(lazy_threshold, expected_stats.threshold);
+
+        size_t const max_lazy_chunks_read[] = { 10, 200, 1000, SIZE_MAX };
+        for (size_t max_chunks_read : max_lazy_chunks_read) {
+            auto hidden = altered;
+            auto stats = hide_in_altered_image(lazy_threshold, hidden, message, 3, 2, 2, 1,
+                max_chunks_read);
+            ASSERT_EQ(hidden.pixel_data, expected.pixel_data)
+                << threshold << ' ' << max_chunks_read;
+            ASSERT_EQ(stats.threshold, expected_stats.threshold);
+            ASSERT_EQ(stats.chunks_used, expected_stats.chunks_used);
+            ASSERT_TRUE(std::equal(std::begin(stats.chunks_used_per_bitplane),
+                std::end(stats.chunks_used_per_bitplane),
+                std::begin(expected_stats.chunks_used_per_bitplane)));
+            ASSERT_EQ(stats.message_bytes_hidden, expected_stats.message_bytes_hidden);
+        }
+
+        auto hidden = img;
+        bpcs_hide(threshold, hidden, message, 3, 2, 2, 1);
+        ASSERT_EQ(hidden.pixel_data, expected.pixel_data);
+    }
+}
+
+TEST(bpcs, extract_with_known_planes) {
+    auto img = generate_random_image(256, 192);
+    std::vector<u8> message(200, 0x5A);
+
+    // nothing is hidden, so there aren't any magic chunks to be found
+    std::array<u8, 4> limits;
+    ASSERT_FALSE(find_magic_chunks(img, limits));
+    ASSERT_THROW(bpcs_extract(img), std::runtime_error);
+
+    bpcs_hide(-1.0f, img, message, 3, 0, 2, 1);
+    ASSERT_TRUE(find_magic_chunks(img, limits));
+    ASSERT_EQ(limits, (std::array<u8, 4>{ 3, 0, 2, 1 }));
+    ASSERT_EQ(bpcs_extract(img, 3, 0, 2, 1), message);
+
+    // with the wrong limits, the magic chunks aren't where they should be
+    ASSERT_THROW(bpcs_extract(img, 3, 0, 2, 2), std::runtime_error);
+    ASSERT_THROW(bpcs_extract(img, 8, 8, 8, 8), std::runtime_error);
+}
+
+TEST(bpcs, find_magic_chunks_in_read_order) {
+    auto img = generate_random_image(128, 96);
+    auto stego = BitplaneImage::from_image(img, generate_bitplane_priority(8, 8, 8, 8));
+
+    // Searching the whole image at once has to find the same magic chunks as reading through the
+    // bitplanes in order would. The first bitplane read is 7, then 15. A magic chunk of the wrong
+    // kind, or one that comes after the one that was being looked for has been found, is skipped.
+    auto wanted = generate_magic_chunks(1, 2, 3, 4);
+    auto unwanted = generate_magic_chunks(5, 6, 7, 8);
+    stego.view(7).replace(50, unwanted[1]);
+    stego.view(7).replace(100, wanted[0]);
+    stego.view(15).replace(10, unwanted[0]);
+    stego.view(15).replace(20, wanted[1]);
+    stego.view(15).replace(30, unwanted[1]);
+    stego.to_image(img);
+
+    std::array<u8, 4> lazy_limits;
+    ASSERT_TRUE(find_magic_chunks(LazyStegoImage(img), SIZE_MAX, lazy_limits));
+    ASSERT_EQ(lazy_limits, (std::array<u8, 4>{ 1, 2, 3, 4 }));
+
+    std::array<u8, 4> limits;
+    ASSERT_TRUE(find_magic_chunks(img, limits));
+    ASSERT_EQ(limits, lazy_limits);
+}
+
+TEST(bpcs, probe) {
+    auto img = generate_random_image(256, 192);
+    ASSERT_FALSE(bpcs_probe(img).found);
+
+    std::vector<u8> message(150, 0x3C);
+    bpcs_hide(-1.0f, img, message, 4, 3, 2, 1);
+    auto result = bpcs_probe(img);
+    ASSERT_TRUE(result.found);
+    ASSERT_EQ(result.rmax, 4);
+    ASSERT_EQ(result.gmax, 3);
+    ASSERT_EQ(result.bmax, 2);
+    ASSERT_EQ(result.amax, 1);
+    ASSERT_EQ(result.message_size, message.size());
+    ASSERT_FALSE(result.corrupt_header);
+
+    // damage the signature of the size chunk, which is the first complex chunk of the message
+    auto bitplane_priority = generate_bitplane_priority(4, 3, 2, 1);
+    auto stego = BitplaneImage::from_image(img, bitplane_priority);
+    auto bitplane = stego.view(bitplane_priority[0]);
+    size_t ci = 0;
+    while (bitplane.transition_count(ci) < MESSAGE_MIN_TRANSITIONS)
+        ci++;
+    auto size_chunk = bitplane[ci];
+    size_chunk.bytes[2] ^= 0x5A;
+    bitplane.replace(ci, size_chunk);
+    stego.to_image(img);
+
+    result = bpcs_probe(img);
+    ASSERT_FALSE(result.found);
+    ASSERT_TRUE(result.corrupt_header);
+    ASSERT_EQ(result.rmax, 4);
+    ASSERT_EQ(result.amax, 1);
+}
+
+TEST(bpcs, probe_missing_size_chunk) {
+    auto img = generate_random_image(256, 192);
+    std::vector<u8> message(150, 0x3C);
+    bpcs_hide(-1.0f, img, message, 1, 0, 0, 0);
+
+    // Zero the only bitplane of the message, which holds the size chunk, but leave copies of the
+    // magic chunks in the next bitplane the search reads, so that they are still found
+    auto stego = BitplaneImage::from_image(img, generate_bitplane_priority(1, 1, 0, 0));
+    auto size_chunk_plane = stego.view(7);
+    for (size_t ci = 0; ci < size_chunk_plane.size; ci++)
+        size_chunk_plane.replace(ci, DataChunk{});
+    auto magic_chunks = generate_magic_chunks(1, 0, 0, 0);
+    stego.view(15).replace(0, magic_chunks[0]);
+    stego.view(15).replace(1, magic_chunks[1]);
+    stego.to_image(img);
+
+    auto result = bpcs_probe(img);
+    ASSERT_FALSE(result.found);
+    ASSERT_TRUE(result.corrupt_header);
+    ASSERT_EQ(result.rmax, 1);
+    ASSERT_EQ(result.gmax, 0);
+    ASSERT_EQ(result.bmax, 0);
+    ASSERT_EQ(result.amax, 0);
+}
+
+TEST(bpcs, hiding_in_stego_image) {
+    // The magic chunks of the first message are in bitplanes which the second message doesn't use,
+    // and would be found first on extraction if they weren't altered
+    std::vector<u8> first_message(300, 0x11);
+    std::vector<u8> second_message(200, 0x22);
+
+    auto img = generate_random_image(160, 160);
+    bpcs_hide(-1.0f, img, first_message, 8, 8, 8, 8);
+    bpcs_hide(-1.0f, img, second_message, 0, 8, 8, 0);
+    ASSERT_EQ(bpcs_extract(img), second_message);
+}
+
+TEST(bpcs, measure_matches_hide) {
+    auto img = generate_random_image(203, 77);
+    auto img_original = img;
+
+    u8 const limits[][4] = { {8, 8, 8, 8}, {3, 0, 5, 1}, {0, 0, 0, 0} };
+    for (auto& limit : limits) {
+        for (float threshold : {0.0f, 0.3f, 0.5f}) {
+            auto measured = bpcs_measure(threshold, img, limit[0], limit[1], limit[2], limit[3]);
+            ASSERT_EQ(img.pixel_data, img_original.pixel_data);
+
+            // a message which can't possibly fit uses every chunk that meets the threshold
+            auto img_hidden = img;
+            std::vector<u8> message(img.pixel_data.size());
+            auto hidden = bpcs_hide(threshold, img_hidden, message,
+                limit[0], limit[1], limit[2], limit[3]);
+
+            ASSERT_EQ(measured.chunks_used, hidden.chunks_used);
+            ASSERT_EQ(measured.message_bytes_hidden, hidden.message_bytes_hidden);
+            ASSERT_TRUE(std::equal(std::begin(measured.chunks_used_per_bitplane),
+                std::end(measured.chunks_used_per_bitplane),
+                std::begin(hidden.chunks_used_per_bitplane)));
+        }
+    }
+
+    // fewer than 8 usable chunks can't hold anything
+    auto small_img = generate_random_image(16, 16);
+    ASSERT_EQ(bpcs_measure(0.0f, small_img, 1, 0, 0, 0).message_bytes_hidden, 0);
+}
+
+TEST(bpcs, capacity_table_matches_measure) {
+    auto img = generate_random_image(120, 64);
+    auto table = bpcs_capacity_table(img);
+    ASSERT_EQ(table.size(), 9 * 9 * 9 * 9);
+
+    for (size_t i = 0; i < table.size(); i += 97) {
+        auto& row = table[i];
+        for (size_t t = 0; t <= MESSAGE_MIN_TRANSITIONS; t += 7) {
+            float threshold = (float)t / (float)MAX_TRANSITIONS;
+            auto stats = bpcs_measure(threshold, img, row.rmax, row.gmax, row.bmax, row.amax);
+            ASSERT_EQ(row.message_capacity[t], stats.message_bytes_hidden);
+        }
+    }
+}
+
+TEST(bpcs, choose_bitplanes) {
+    // Only the two least significant bitplanes of red and green have any complex chunks, 100
+    // each. Green's second bitplane is only complex up to a threshold of 40 / 112.
+    std::array<TransitionHistogram, 32> histograms = {};
+    for (size_t bitplane_index = 0; bitplane_index < 32; bitplane_index++)
+        histograms[bitplane_index][0] = 100;
+    for (size_t bitplane_index : {7, 6, 15}) {
+        histograms[bitplane_index][0] = 0;
+        histograms[bitplane_index][MAX_TRANSITIONS] = 100;
+    }
+    histograms[14][0] = 0;
+    histograms[14][40] = 100;
+
+    auto choice = choose_bitplanes(histograms, 150, -1.0f);
+    ASSERT_EQ((int)choice.rmax, 1);
+    ASSERT_EQ((int)choice.gmax, 1);
+    ASSERT_EQ((int)choice.bmax, 0);
+    ASSERT_EQ((int)choice.amax, 0);
+    ASSERT_EQ(choice.threshold, 0.5f);
+
+    // red's second bitplane costs the same as green's, but green's is below the threshold floor
+    choice = choose_bitplanes(histograms, 250, -1.0f);
+    ASSERT_EQ((int)choice.rmax, 2);
+    ASSERT_EQ((int)choice.gmax, 1);
+    ASSERT_EQ(choice.threshold, 0.5f);
+
+    choice = choose_bitplanes(histograms, 350, -1.0f);
+    ASSERT_EQ((int)choice.rmax, 2);
+    ASSERT_EQ((int)choice.gmax, 2);
+    ASSERT_EQ(choice.threshold, 40.0f / MAX_TRANSITIONS);
+
+    // with a fixed threshold, green's second bitplane is no use
+    choice = choose_bitplanes(histograms, 350, 0.5f);
+    ASSERT_EQ((int)choice.rmax, 8);
+    ASSERT_EQ((int)choice.gmax, 8);
+    ASSERT_EQ(choice.threshold, 0.5f);
+}
+
+TEST(bpcs, choose_bitplanes_prefers_least_significant) {
+    // The least significant bitplanes of red, green and blue are complex up to a threshold of
+    // 50 / 112. Only the most significant ones are complex enough for 0.5, and so is alpha's least
+    // significant one, with room for 200 chunks.
+    std::array<TransitionHistogram, 32> histograms = {};
+    for (size_t bitplane_index = 0; bitplane_index < 32; bitplane_index++)
+        histograms[bitplane_index][0] = 100;
+    for (size_t bitplane_index : {7, 15, 23}) {
+        histograms[bitplane_index][0] = 0;
+        histograms[bitplane_index][50] = 100;
+    }
+    for (size_t bitplane_index : {0, 8, 16}) {
+        histograms[bitplane_index][0] = 0;
+        histograms[bitplane_index][MAX_TRANSITIONS] = 100;
+    }
+    histograms[31][0] = 0;
+    histograms[31][MAX_TRANSITIONS] = 200;
+
+    // a slightly lower threshold is better than using the most significant bitplanes, and alpha
+    // isn't needed
+    auto choice = choose_bitplanes(histograms, 250, -1.0f);
+    ASSERT_EQ((int)choice.rmax, 1);
+    ASSERT_EQ((int)choice.gmax, 1);
+    ASSERT_EQ((int)choice.bmax, 1);
+    ASSERT_EQ((int)choice.amax, 0);
+    ASSERT_EQ(choice.threshold, 50.0f / MAX_TRANSITIONS);
+
+    // any two of the three least significant bitplanes are just as good
+    choice = choose_bitplanes(histograms, 150, -1.0f);
+    ASSERT_LE((int)choice.rmax, 1);
+    ASSERT_LE((int)choice.gmax, 1);
+    ASSERT_LE((int)choice.bmax, 1);
+    ASSERT_EQ(choice.rmax + choice.gmax + choice.bmax, 2);
+    ASSERT_EQ((int)choice.amax, 0);
+
+    // red, green and blue have 2400 chunks in all, so this needs alpha
+    choice = choose_bitplanes(histograms, 2450, -1.0f);
+    ASSERT_GT((int)choice.amax, 0);
+    ASSERT_EQ(choice.threshold, 0.0f);
+}
+
+TEST(bpcs, hide_auto_planes) {
+    auto img = generate_random_image(257, 135);
+    std::vector<u8> message(100, 0x5A);
+
+    auto stats = bpcs_hide_auto_planes(-1.0f, img, message);
+    ASSERT_EQ(stats.message_bytes_hidden, message.size());
+    ASSERT_EQ(bpcs_extract(img), message);
+
+    // A message this small fits in the least significant bitplanes. Most of the image is flat, so
+    // that may take a threshold a little below 0.5, but not below the floor.
+    ASSERT_GE(stats.threshold,
+        (float)(MESSAGE_MIN_TRANSITIONS - AUTO_PLANES_THRESHOLD_MARGIN) / MAX_TRANSITIONS);
+    for (size_t bitplane_index = 0; bitplane_index < 32; bitplane_index++) {
+        if (bitplane_index % 8 < 7) {
+            ASSERT_EQ(stats.chunks_used_per_bitplane[bitplane_index], 0) << bitplane_index;
+        }
+    }
+
+    auto probed = bpcs_probe(img);
+    ASSERT_TRUE(probed.found);
+    ASSERT_LE(probed.rmax, 1);
+    ASSERT_LE(probed.gmax, 1);
+    ASSERT_LE(probed.bmax, 1);
+    ASSERT_EQ(probed.amax, 0);
+}
+
 TEST(bpcs, generate_bitplane_priority) {
     auto bitplane_priority = generate_bitplane_priority(0, 0, 0, 0);
     ASSERT_EQ(bitplane_priority.empty(), true);
@@ -0,0 +1,183 @@
+// Benjamin Lindley, Vanessa Martinez
+//
+// complexity.cpp
+//
+// Counts the bit transitions (see DataChunk::count_transitions()) of whole arrays of chunks at
+// once. Finding the complexity threshold, hiding and extracting all need the complexity of every
+// chunk of one or more bitplanes, so this is done for millions of chunks at a time.
+//
+// Besides the scalar version, there are AVX2 and AVX-512 versions which work on 4 and 8 chunks at
+// a time. Neither instruction set has a byte popcount of its own (AVX-512 only does with the
+// BITALG extension), so the bits are counted by looking up each nibble in a 16 entry table with a
+// byte shuffle, and the byte counts of each chunk are added up with a sum of absolute differences
+// against zero. The one to use is picked at runtime, like the slicing kernels in bitslice.cpp.
+
+#include <algorithm>
+
+#include "declarations.h"
+
+#if STEG_X86
+#include <immintrin.h>
+#endif
+
+void count_transitions_scalar(DataChunk const* chunks, size_t count, u8* counts_out) {
+    for (size_t i = 0; i < count; i++)
+        counts_out[i] = chunks[i].count_transitions();
+}
+
+#if STEG_X86
+
+// Counts the set bits of each byte, by looking up each nibble in a table
+STEG_TARGET("avx2")
+static inline __m256i popcount_bytes_avx2(__m256i v) {
+    __m256i const nibble_counts = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    __m256i const low_nibbles = _mm256_set1_epi8(0x0F);
+    __m256i lo = _mm256_and_si256(v, low_nibbles);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, lo),
+        _mm256_shuffle_epi8(nibble_counts, hi));
+}
+
+// The masks are the same as in DataChunk::count_transitions(), applied to 4 chunks at a time
+STEG_TARGET("avx2")
+void count_transitions_avx2(DataChunk const* chunks, size_t count, u8* counts_out) {
+    __m256i const horizontal_mask = _mm256_set1_epi64x((long long)0xFEFEFEFEFEFEFEFEull);
+    __m256i const vertical_mask = _mm256_set1_epi64x((long long)0x00FFFFFFFFFFFFFFull);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i x = _mm256_loadu_si256((__m256i const*)chunks[i].bytes);
+        __m256i horizontal = _mm256_and_si256(_mm256_xor_si256(x, _mm256_slli_epi64(x, 1)),
+            horizontal_mask);
+        __m256i vertical = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 8)),
+            vertical_mask);
+
+        __m256i byte_counts = _mm256_add_epi8(popcount_bytes_avx2(horizontal),
+            popcount_bytes_avx2(vertical));
+        __m256i sums = _mm256_sad_epu8(byte_counts, _mm256_setzero_si256());
+
+        // each count is in the low byte of its 64-bit lane, so gather those into 4 bytes
+        __m256i packed = _mm256_shuffle_epi8(sums, _mm256_setr_epi8(
+            0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+        u32 lo = (u32)_mm256_extract_epi16(packed, 0);
+        u32 hi = (u32)_mm256_extract_epi16(packed, 8);
+        u32 four_counts = lo | (hi << 16);
+        std::memcpy(counts_out + i, &four_counts, 4);
+    }
+    count_transitions_scalar(chunks + i, count - i, counts_out + i);
+}
+
+STEG_TARGET("avx512f,avx512bw")
+static inline __m512i popcount_bytes_avx512(__m512i v) {
+    __m512i const nibble_counts = _mm512_broadcast_i32x4(_mm_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    __m512i const low_nibbles = _mm512_set1_epi8(0x0F);
+    __m512i lo = _mm512_and_si512(v, low_nibbles);
+    __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_nibbles);
+    return _mm512_add_epi8(_mm512_shuffle_epi8(nibble_counts, lo),
+        _mm512_shuffle_epi8(nibble_counts, hi));
+}
+
+// Same as the AVX2 version, but with 8 chunks at a time
+STEG_TARGET("avx512f,avx512bw")
+void count_transitions_avx512(DataChunk const* chunks, size_t count, u8* counts_out) {
+    __m512i const horizontal_mask = _mm512_set1_epi64((long long)0xFEFEFEFEFEFEFEFEull);
+    __m512i const vertical_mask = _mm512_set1_epi64((long long)0x00FFFFFFFFFFFFFFull);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i x = _mm512_loadu_si512(chunks[i].bytes);
+        __m512i horizontal = _mm512_and_si512(_mm512_xor_si512(x, _mm512_slli_epi64(x, 1)),
+            horizontal_mask);
+        __m512i vertical = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi64(x, 8)),
+            vertical_mask);
+
+        __m512i byte_counts = _mm512_add_epi8(popcount_bytes_avx512(horizontal),
+            popcount_bytes_avx512(vertical));
+        __m512i sums = _mm512_sad_epu8(byte_counts, _mm512_setzero_si512());
+        _mm_storel_epi64((__m128i*)(counts_out + i), _mm512_cvtepi64_epi8(sums));
+    }
+    count_transitions_scalar(chunks + i, count - i, counts_out + i);
+}
+
+#endif // STEG_X86
+
+// Returns all of the transition counting kernels which the processor we are running on supports,
+// slowest first
+std::vector<TransitionKernel> supported_transition_kernels() {
+    std::vector<TransitionKernel> kernels;
+    kernels.push_back({"scalar", count_transitions_scalar});
+#if STEG_X86
+    if (cpu_has_avx2())
+        kernels.push_back({"avx2", count_transitions_avx2});
+    if (cpu_has_avx512bw())
+        kernels.push_back({"avx512", count_transitions_avx512});
+#endif
+    return kernels;
+}
+
+// Returns the fastest transition counting kernel which the processor we are running on supports
+TransitionKernel const& best_transition_kernel() {
+    static TransitionKernel const kernel = supported_transition_kernels().back();
+    return kernel;
+}
+
+// Counts the bit transitions of each of <count> chunks, writing them to <counts_out>
+//
+// Large arrays are split between threads (see parallel_for(...)).
+void count_transitions(DataChunk const* chunks, size_t count, u8* counts_out) {
+    auto& kernel = best_transition_kernel();
+
+    // below this, starting up the other threads costs more than it saves
+    size_t const min_parallel_count = 1 << 16;
+    if (count < min_parallel_count) {
+        kernel.count_transitions(chunks, count, counts_out);
+        return;
+    }
+
+    parallel_for(count, [&](size_t begin, size_t end) {
+        kernel.count_transitions(chunks + begin, end - begin, counts_out + begin);
+    });
+}
+
+#ifdef STEG_TEST
+
+#include <gtest/gtest.h>
+#include <random>
+
+TEST(complexity, kernels_match_scalar) {
+    std::mt19937_64 gen(8642);
+    std::vector<DataChunk> chunks(1003);
+    for (auto& chunk : chunks) {
+        u64 value = gen();
+        // mix in some sparse chunks, so that the counts cover the whole range
+        if (gen() % 2)
+            value &= gen() & gen();
+        std::memcpy(chunk.bytes, &value, 8);
+    }
+    chunks[0] = { 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA };
+    chunks[1] = {};
+
+    std::vector<u8> expected(chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++)
+        expected[i] = chunks[i].count_transitions();
+    ASSERT_EQ(expected[0], MAX_TRANSITIONS);
+    ASSERT_EQ(expected[1], 0);
+
+    // odd offsets and sizes, so that the leftovers and unaligned loads get tested too
+    for (auto& kernel : supported_transition_kernels()) {
+        for (size_t offset : {0, 1, 3}) {
+            for (size_t count : {0, 1, 7, 8, 9, 64, 1000}) {
+                std::vector<u8> counts(count, 0xFF);
+                kernel.count_transitions(chunks.data() + offset, count, counts.data());
+                ASSERT_TRUE(std::equal(counts.begin(), counts.end(), expected.begin() + offset))
+                    << kernel.name << " count " << count;
+            }
+        }
+    }
+}
+
+#endif // STEG_TEST
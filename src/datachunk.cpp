@@ -3,47 +3,57 @@
 // datachunk.cpp
 //
 // A DataChunk is just an 8 byte array with some convenient functions. This is the fundamental unit
-// of data hiding in BPCS. The DataChunk is used in two separate places. In bpcs.cpp, the cover
-// image is broken into 8x8 bitplane chunks. These bits are extracted into a DataChunk. Also, in
-// message.cpp, the message is formatted into DataChunks. Then, formatted message datachunks can
-// just be copied over cover image datachunks, instead of working at the byte level.
+// of data hiding in BPCS. The DataChunk is used in two separate places. In bitplaneimage.cpp,
+// the cover image is broken into 8x8 bitplane chunks. These bits are extracted into a DataChunk.
+// Also, in message.cpp, the message is formatted into DataChunks. Then, formatted message
+// datachunks can just be copied over cover image datachunks, instead of working at the byte level.
 
 #include <algorithm>
 #include <bit>
-#include <map>
+#include <cmath>
+#include <array>
 #include <vector>
 #include <stdexcept>
 
 #include "declarations.h"
 
-// Counts all the bit transitions, from 1 to 0, or from 0 to 1, in a byte
-size_t count_bit_transitions(u8 byte) {
-    u8 x = (byte ^ (byte << 1)) & 0b11111110;
-    return std::popcount(x);
-}
-
-// Counts the bit differences at each corresponding position of 2 bytes
-size_t count_bit_differences(u8 a, u8 b) {
-    u8 diff = a ^ b;
-    return std::popcount(diff);
-}
-
 // Measure the complexity of a chunk
 //
 // Complexity is measured by counting the vertical and horizontal bit transitions in a chunk. Then
 // dividing by 112, which is the maximum possible number of transitions in an 8x8 chunk.
+//
+// All of the decisions about which chunks are complex enough are made on the transition count
+// instead (see threshold_to_transitions(...)). This is only for reporting.
 float DataChunk::measure_complexity() const {
-    size_t count = 0;
-    for (size_t i = 0; i < 8; i++) {
-        count += count_bit_transitions(bytes[i]);
-    }
+    return (float)count_transitions() / (float)MAX_TRANSITIONS;
+}
 
-    for (size_t i = 0; i < 7; i++) {
-        count += count_bit_differences(bytes[i], bytes[i+1]);
-    }
+// Converts a complexity threshold to the minimum number of bit transitions a chunk needs to meet it
+//
+// This is the smallest count c for which c / 112 >= threshold, computed the same way as
+// measure_complexity(...), so the decision for any chunk is exactly the same as comparing its
+// complexity against the threshold. Returns MAX_TRANSITIONS + 1 if no chunk can meet it.
+//
+// The count is ceil(threshold * 112), except that the float division can round c / 112 to just
+// either side of the threshold, so the neighboring count is checked the same way and taken instead
+// if it's the one that gives the right answer.
+u8 threshold_to_transitions(float threshold) {
+    if (threshold <= 0.0f)
+        return 0;
+    // this also catches NaN, which no complexity is >= to
+    if (!(threshold <= 1.0f))
+        return MAX_TRANSITIONS + 1;
+
+    auto meets = [&](size_t count) {
+        return (float)count / (float)MAX_TRANSITIONS >= threshold;
+    };
 
-    size_t const max_bit_transitions = 2 * 7 * 8;
-    return (float)count / (float)max_bit_transitions;
+    size_t count = (size_t)std::ceil((double)threshold * MAX_TRANSITIONS);
+    if (count > 0 && meets(count - 1))
+        count--;
+    else if (!meets(count))
+        count++;
+    return (u8)count;
 }
 
 // Makes a non complex chunk complex, or vice versa
@@ -70,74 +80,64 @@ void DataChunk::conjugate() {
 // Used for calculating the complexity threshold
 //
 // Based on the idea of a Cumulative Distribution Function, can be queried for a complexity
-// threshold T, and returns how many chunks in the supplied DataChunkArray have complexity >= T
+// threshold T, and returns how many chunks in the supplied bitplanes have complexity >= T
+//
+// There are only MAX_TRANSITIONS + 1 possible transition counts, so the distribution is a fixed
+// array with one entry per count, and one extra entry at the end which is always 0.
 struct CDF {
-    CDF(DataChunkArray const& chunks, std::vector<size_t> const& bitplane_priority);
+    CDF(BitplaneImage const& cover, std::vector<size_t> const& bitplane_priority);
     size_t query(float threshold) const;
     float max_threshold_to_store(size_t chunk_count) const;
 
-    std::vector<std::pair<float, size_t>> inner;
+    std::array<size_t, MAX_TRANSITIONS + 2> at_least = {};
 };
 
 // Generate the cumulative distribution of complex chunks
 //
-// First generate a histogram of all of the different complexity levels. Then use this to generate a
-// cumulative distribution function (cdf). A cdf is like a histogram, but where histogram[x] = the
-// number of elements which are equal to x, cdf[x] = the number of elements which are greater than
-// or equal to x.
-CDF::CDF(DataChunkArray const& chunks, std::vector<size_t> const& bitplane_priority) {
-    size_t chunks_per_bitplane = chunks.chunks.size() / 32;
-
-    std::map<float, size_t> hist;
+// First generate a histogram of the transition counts. Then use this to generate a cumulative
+// distribution function (cdf). A cdf is like a histogram, but where histogram[x] = the number of
+// elements which are equal to x, cdf[x] = the number of elements which are greater than or equal to
+// x. So it is just the histogram summed from the top down.
+//
+// The order of the chunks doesn't matter for counting them, so each bitplane's transition counts
+// are read straight through in spatial order.
+CDF::CDF(BitplaneImage const& cover, std::vector<size_t> const& bitplane_priority) {
+    TransitionHistogram hist = {};
 
     for (size_t bp = 0; bp < bitplane_priority.size(); bp++) {
-        size_t bitplane_index = bitplane_priority[bp];
-
-        for (size_t ci = 0; ci < chunks_per_bitplane; ci++) {
-            size_t chunk_index = bitplane_index * chunks_per_bitplane + ci;
-
-            auto& chunk = chunks.chunks[chunk_index];
-            auto complexity = chunk.measure_complexity();
-            hist[complexity]++;
-        }
-    }
-
-    size_t cumulative = 0;
-    for (auto i_hist = hist.rbegin(); i_hist != hist.rend(); ++i_hist) {
-        cumulative += i_hist->second;
-        inner.emplace_back(i_hist->first, cumulative);
+        auto transitions = cover.bitplane_transitions(bitplane_priority[bp]);
+        for (size_t i = 0; i < cover.chunks_per_bitplane; i++)
+            hist[transitions[i]]++;
     }
 
-    std::reverse(inner.begin(), inner.end());
+    for (size_t count = MAX_TRANSITIONS + 1; count-- > 0;)
+        at_least[count] = at_least[count + 1] + hist[count];
 }
 
 // returns the count of chunks which have complexity >= threshold
 size_t CDF::query(float threshold) const {
-    auto compare_to_first = [](auto&& p, float v) { return p.first < v; };
-    auto it = std::lower_bound(inner.begin(), inner.end(), threshold, compare_to_first);
-    if (it == inner.end())
-        return 0;
-    return it->second;
+    return at_least[threshold_to_transitions(threshold)];
 }
 
 
 // Returns the maximum complexity threshold that can be used if you need to store the specified
 // number of chunks.
 //
+// Only thresholds of the form count / MAX_TRANSITIONS can make a difference, so this is the
+// largest one of those which leaves enough chunks.
+//
 // A negative value indicates that many chunks can not fit at any threshold
 float CDF::max_threshold_to_store(size_t chunk_count) const {
-    size_t granularity = 512;
-    for (size_t i = 0; i <= granularity; i++) {
-        float threshold = (float)(granularity - i) / (float)granularity;
-        if (this->query(threshold) >= chunk_count)
-            return threshold;
+    for (size_t count = MAX_TRANSITIONS + 1; count-- > 0;) {
+        if (at_least[count] >= chunk_count)
+            return (float)count / (float)MAX_TRANSITIONS;
     }
     return -1.0f;
 }
 
 // Calculates the maximum threshold that can be used to store the given number of chunks in the
 // given cover, using the specified bitplanes
-float calculate_max_threshold(size_t message_chunk_count, DataChunkArray const& cover,
+float calculate_max_threshold(size_t message_chunk_count, BitplaneImage const& cover,
     std::vector<size_t> const& bitplane_priority)
 {
     CDF cdf(cover, bitplane_priority);
@@ -154,6 +154,7 @@ float calculate_max_threshold(size_t message_chunk_count, DataChunkArray const&
 #ifdef STEG_TEST
 
 #include <gtest/gtest.h>
+#include <cmath>
 #include <random>
 
 void randomize_chunk(std::mt19937_64& rng, DataChunk& chunk) {
@@ -221,9 +222,65 @@ TEST(datachunk, measure_complexity) {
     ASSERT_EQ(chunk.measure_complexity(), 0.5f);
 }
 
+TEST(datachunk, count_transitions) {
+    std::mt19937_64 gen64(777);
+
+    // compare against counting one bit at a time
+    DataChunk chunk;
+    for (int i = 0; i < 2000; i++) {
+        randomize_chunk(gen64, chunk);
+
+        size_t expected = 0;
+        for (size_t row = 0; row < 8; row++) {
+            for (size_t col = 0; col < 8; col++) {
+                u8 bit = get_bit(chunk.bytes, row * 8 + col);
+                if (col < 7 && bit != get_bit(chunk.bytes, row * 8 + col + 1))
+                    expected++;
+                if (row < 7 && bit != get_bit(chunk.bytes, (row + 1) * 8 + col))
+                    expected++;
+            }
+        }
+
+        ASSERT_EQ(chunk.count_transitions(), expected);
+        chunk.conjugate();
+        ASSERT_EQ(chunk.count_transitions(), MAX_TRANSITIONS - expected);
+    }
+}
+
+TEST(datachunk, threshold_to_transitions) {
+    ASSERT_EQ(threshold_to_transitions(0.0f), 0);
+    ASSERT_EQ(threshold_to_transitions(0.5f), MESSAGE_MIN_TRANSITIONS);
+    ASSERT_EQ(threshold_to_transitions(1.0f), MAX_TRANSITIONS);
+    ASSERT_EQ(threshold_to_transitions(1.01f), MAX_TRANSITIONS + 1);
+    ASSERT_EQ(threshold_to_transitions(-0.25f), 0);
+    ASSERT_EQ(threshold_to_transitions(std::nanf("")), MAX_TRANSITIONS + 1);
+
+    // every count must get the same decision as the float comparison, including thresholds which
+    // land exactly on, or just next to, a count
+    std::vector<float> thresholds;
+    for (size_t i = 0; i <= 512; i++)
+        thresholds.push_back((float)i / 512.0f);
+    for (size_t count = 0; count <= MAX_TRANSITIONS; count++) {
+        float complexity = (float)count / (float)MAX_TRANSITIONS;
+        thresholds.push_back(complexity);
+        thresholds.push_back(std::nextafter(complexity, 0.0f));
+        thresholds.push_back(std::nextafter(complexity, 1.0f));
+    }
+
+    for (float threshold : thresholds) {
+        u8 min_transitions = threshold_to_transitions(threshold);
+        for (size_t count = 0; count <= MAX_TRANSITIONS; count++) {
+            float complexity = (float)count / (float)MAX_TRANSITIONS;
+            ASSERT_EQ(count >= min_transitions, complexity >= threshold) << threshold;
+        }
+    }
+}
+
 TEST(datachunk, CDF) {
-    DataChunkArray chunks;
-    chunks.chunks.resize(17*32);
+    BitplaneImage chunks;
+    chunks.chunks.resize(17);
+    chunks.bitplanes = {0};
+    chunks.chunks_per_bitplane = 17;
     chunks.chunks[0] = {};
     chunks.chunks[1] = { 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, };
     chunks.chunks[2] = { 0x00, 0x07, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, };
@@ -246,6 +303,7 @@ TEST(datachunk, CDF) {
         ASSERT_EQ(actual_complexity, expected_complexity);
     }
 
+    chunks.recount_transitions();
     std::vector<size_t> bitplane_priority(1, 0);
     CDF cdf(chunks, bitplane_priority);
 
@@ -257,6 +315,13 @@ TEST(datachunk, CDF) {
 
     ASSERT_EQ(cdf.max_threshold_to_store(0), 1.0f);
     ASSERT_LT(cdf.max_threshold_to_store(18), 0.0f);
+
+    for (size_t count = 0; count <= MAX_TRANSITIONS + 1; count++) {
+        float threshold = (float)count / (float)MAX_TRANSITIONS;
+        size_t expected = std::count_if(chunks.chunks.begin(), chunks.chunks.end(),
+            [&](DataChunk const& chunk) { return chunk.measure_complexity() >= threshold; });
+        ASSERT_EQ(cdf.query(threshold), expected) << threshold;
+    }
 }
 
 #endif // STEG_TEST
@@ -6,10 +6,15 @@
 #define DECLARATIONS_202307272153
 
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <vector>
 #include <array>
+#include <functional>
+#include <memory>
+#include <bit>
+#include <span>
 
 using u8 = std::uint8_t;
 using u16 = std::uint16_t;
@@ -20,6 +25,31 @@ using u64 = std::uint64_t;
 // bitplanes 7 and 8 often has very noticable distortion, from experiment.
 #define DEFAULT_BITPLANE_USAGE 6
 
+// The SIMD kernels are only compiled for x86 processors. Everywhere else, only the scalar versions
+// are available.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define STEG_X86 1
+#else
+#define STEG_X86 0
+#endif
+
+// GCC and Clang only allow intrinsics for instruction sets which are either enabled for the whole
+// build, or enabled for a specific function with this attribute. MSVC allows any intrinsic
+// anywhere.
+#if defined(__GNUC__) || defined(__clang__)
+#define STEG_TARGET(isa) __attribute__((target(isa)))
+#else
+#define STEG_TARGET(isa)
+#endif
+
+// Files are memory mapped, and read with the system calls directly, only where the POSIX functions
+// for that are available. Everywhere else, the standard library is used.
+#if defined(__unix__) || defined(__APPLE__)
+#define STEG_POSIX 1
+#else
+#define STEG_POSIX 0
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // args.cpp
 ////////////////////////////////////////////////////////////////////////////////
@@ -30,8 +60,14 @@ struct Args {
     bool extract;
     bool hide;
     bool measure;
+    bool capacity_table;
+    bool probe;
+    bool json;
+    bool auto_planes;
+    bool known_planes;
     int random_count;
     std::string message_file;
+    size_t message_size;
     std::string cover_file;
     std::string stego_file;
     std::string output_file;
@@ -40,6 +76,8 @@ struct Args {
     u8 gmax;
     u8 bmax;
     u8 amax;
+    size_t threads;
+    std::string permutation_cache_dir;
 };
 
 Args parse_args(int argc, char** argv);
@@ -55,13 +93,46 @@ std::string get_file_extension(std::string const& filename);
 void save_file(std::string const& filename, u8 const* data, size_t len);
 void save_file(std::string const& filename, std::vector<u8> const& data);
 std::vector<u8> load_file(std::string const& filename);
+
+// A buffer allocated with malloc, which can be grown with realloc
+using MallocBuffer = std::unique_ptr<u8, void (*)(void*)>;
+
+// The read-only contents of a file, or of standard input if the filename is "-"
+//
+// Regular files are memory mapped, so that they are read straight from the page cache as they are
+// used, without first being copied into a zero filled buffer. Anything which can't be mapped, such
+// as a pipe, is read into <buffer> instead. Either way, <bytes> is the contents.
+struct FileContents {
+    std::span<u8 const> bytes;
+    MallocBuffer buffer = { nullptr, std::free };
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    explicit FileContents(std::string const& filename, size_t size_hint = 0);
+    FileContents(FileContents const&) = delete;
+    FileContents& operator=(FileContents const&) = delete;
+    ~FileContents();
+};
 std::vector<u8> random_bytes(size_t size);
+bool cpu_has_sse2();
+bool cpu_has_avx2();
+bool cpu_has_avx512bw();
+void set_thread_count(size_t count);
+size_t get_thread_count();
+void parallel_for(size_t count, std::function<void(size_t, size_t)> const& fn);
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // datachunk.cpp
 ////////////////////////////////////////////////////////////////////////////////
 
+// The maximum number of bit transitions in an 8x8 chunk, 7 in each of the 8 rows and 8 columns
+#define MAX_TRANSITIONS 112
+
+// Every chunk of a formatted message has at least this many bit transitions, which is a complexity
+// of 0.5 (see conjugate_groups(...))
+#define MESSAGE_MIN_TRANSITIONS 56
+
 // 64 bits, the fundamental unit of data hiding in BPCS
 // 
 // The cover image is broken up into an array data chunks, each representing
@@ -81,6 +152,21 @@ struct DataChunk {
 
     float measure_complexity() const;
     void conjugate();
+
+    // Counts the bit transitions, horizontal and vertical, from 0 to MAX_TRANSITIONS
+    //
+    // The chunk is loaded as a single u64. XORing it with itself shifted by one bit marks every
+    // horizontal transition, and the mask throws away the bits which crossed from one row into the
+    // next. XORing it with itself shifted by one byte marks every vertical transition, and the mask
+    // throws away the last row, which has no row below it. This is defined here so that it can be
+    // inlined into the loops that call it for every chunk of an image.
+    u8 count_transitions() const {
+        u64 x;
+        std::memcpy(&x, bytes, 8);
+        u64 horizontal = (x ^ (x << 1)) & 0xFEFEFEFEFEFEFEFEull;
+        u64 vertical = (x ^ (x >> 8)) & 0x00FFFFFFFFFFFFFFull;
+        return (u8)(std::popcount(horizontal) + std::popcount(vertical));
+    }
 };
 
 // An array of data chunks
@@ -110,10 +196,105 @@ struct DataChunkArray {
     }
 };
 
-float calculate_max_threshold(size_t message_chunk_count, DataChunkArray const& cover_chunks,
+struct BitplaneImage;
+
+// How many chunks have each possible number of bit transitions
+using TransitionHistogram = std::array<size_t, MAX_TRANSITIONS + 1>;
+
+u8 threshold_to_transitions(float threshold);
+float calculate_max_threshold(size_t message_chunk_count, BitplaneImage const& cover,
     std::vector<size_t> const& bitplane_priority);
 
 
+////////////////////////////////////////////////////////////////////////////////
+// bitslice.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+// A pair of functions for converting between 8x8 blocks of pixels and their 32 bitplane chunks,
+// implemented with one particular instruction set
+struct SliceKernel {
+    char const* name;
+    void (*slice_block)(u8 const* block_ptr, size_t row_stride, DataChunk* chunks_out);
+    void (*unslice_block)(DataChunk const* chunks, u8* block_ptr, size_t row_stride);
+};
+
+u64 transpose_8x8(u64 x);
+void slice_block_scalar(u8 const* block_ptr, size_t row_stride, DataChunk* chunks_out);
+void unslice_block_scalar(DataChunk const* chunks, u8* block_ptr, size_t row_stride);
+void binary_to_gray_code_chunks(DataChunk* chunks);
+void gray_code_to_binary_chunks(DataChunk* chunks);
+std::vector<SliceKernel> supported_slice_kernels();
+SliceKernel const& best_slice_kernel();
+
+
+////////////////////////////////////////////////////////////////////////////////
+// complexity.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+// A function for counting the bit transitions of an array of chunks, implemented with one
+// particular instruction set
+struct TransitionKernel {
+    char const* name;
+    void (*count_transitions)(DataChunk const* chunks, size_t count, u8* counts_out);
+};
+
+std::vector<TransitionKernel> supported_transition_kernels();
+TransitionKernel const& best_transition_kernel();
+void count_transitions(DataChunk const* chunks, size_t count, u8* counts_out);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// magicsearch.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+// A function for finding the magic chunks in an array of chunks, implemented with one particular
+// instruction set
+struct MagicSearchKernel {
+    char const* name;
+    size_t (*find_magic_chunk)(DataChunk const* chunks, size_t count);
+};
+
+std::vector<MagicSearchKernel> supported_magic_search_kernels();
+MagicSearchKernel const& best_magic_search_kernel();
+size_t find_magic_chunk(DataChunk const* chunks, size_t count);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// graycode.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+// A pair of functions for converting whole buffers to and from gray code, implemented with one
+// particular instruction set
+struct GrayCodeKernel {
+    char const* name;
+    void (*to_gray_code)(u8* data, size_t size);
+    void (*to_binary)(u8* data, size_t size);
+};
+
+u8 binary_to_gray_code(u8 binary);
+u8 gray_code_to_binary(u8 gray_code);
+void binary_to_gray_code_inplace(std::vector<u8>& vec);
+void gray_code_to_binary_inplace(std::vector<u8>& vec);
+std::vector<GrayCodeKernel> supported_gray_code_kernels();
+GrayCodeKernel const& best_gray_code_kernel();
+
+
+////////////////////////////////////////////////////////////////////////////////
+// permutation.cpp
+////////////////////////////////////////////////////////////////////////////////
+std::vector<u32> generate_chunk_shuffle(size_t width, size_t height);
+std::shared_ptr<std::vector<u32> const> get_chunk_shuffle(size_t width, size_t height);
+void set_permutation_cache_dir(std::string const& directory);
+void clear_permutation_cache();
+
+using ChunkPriorityOp = std::function<void(size_t bitplane_index, size_t position,
+    std::vector<u32> const& chunk_priority)>;
+void for_each_chunk_priority(size_t width, size_t height, std::vector<size_t> const& bitplanes,
+    ChunkPriorityOp const& op);
+void chunk_priority_range(std::vector<u32> const& shuffle, size_t bitplane_index,
+    size_t position, size_t count, u32* block_indices_out);
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // datachunk.cpp
 ////////////////////////////////////////////////////////////////////////////////
@@ -127,16 +308,130 @@ struct Image {
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+// bitplaneimage.cpp
+////////////////////////////////////////////////////////////////////////////////
+
+// One bitplane's chunks, seen in the randomized order used for hiding. view[ci] is the chunk at
+// position ci of that order, block_index(ci) is where it is in the image, and
+// transition_count(ci) is its number of bit transitions.
+struct BitplaneView {
+    DataChunk* chunks;
+    u8* transitions;
+    u32 const* order;
+    size_t size;
+
+    DataChunk& operator[](size_t ci) const { return chunks[order[ci]]; }
+    size_t block_index(size_t ci) const { return order[ci]; }
+    u8 transition_count(size_t ci) const { return transitions[order[ci]]; }
+
+    // Replaces a chunk, keeping its transition count up to date
+    void replace(size_t ci, DataChunk const& chunk) const {
+        chunks[order[ci]] = chunk;
+        transitions[order[ci]] = chunk.count_transitions();
+    }
+};
+
+struct ConstBitplaneView {
+    DataChunk const* chunks;
+    u8 const* transitions;
+    u32 const* order;
+    size_t size;
+
+    DataChunk const& operator[](size_t ci) const { return chunks[order[ci]]; }
+    size_t block_index(size_t ci) const { return order[ci]; }
+    u8 transition_count(size_t ci) const { return transitions[order[ci]]; }
+};
+
+// Some of the bitplanes of an image, split into chunks
+//
+// <bitplanes> lists which bitplanes are held, in the order they are stored, with
+// <chunks_per_bitplane> chunks each. Within a bitplane, <chunks> is in spatial order, so
+// chunks[p * chunks_per_bitplane + i] belongs to block i of the image. <transitions> holds the
+// number of bit transitions of each chunk, and <chunk_order> the randomized order of each bitplane,
+// both in the same layout.
+struct BitplaneImage {
+    size_t width = 0;
+    size_t height = 0;
+    size_t chunks_per_bitplane = 0;
+    std::vector<size_t> bitplanes;
+    std::vector<DataChunk> chunks;
+    std::vector<u8> transitions;
+    std::vector<u32> chunk_order;
+
+    static BitplaneImage from_image(Image const& img, std::vector<size_t> const& bitplanes,
+        SliceKernel const& kernel = best_slice_kernel());
+    void to_image(Image& img, SliceKernel const& kernel = best_slice_kernel()) const;
+    void blocks_to_image(Image& img, std::vector<size_t> const& block_indices,
+        SliceKernel const& kernel = best_slice_kernel()) const;
+
+    size_t bitplane_position(size_t bitplane_index) const;
+    DataChunk* bitplane_begin(size_t bitplane_index);
+    DataChunk const* bitplane_begin(size_t bitplane_index) const;
+    u8 const* bitplane_transitions(size_t bitplane_index) const;
+    void recount_transitions();
+    BitplaneView view(size_t bitplane_index);
+    ConstBitplaneView view(size_t bitplane_index) const;
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // message.cpp
 ////////////////////////////////////////////////////////////////////////////////
 extern u8 const SIGNATURE[3];
 extern u8 const MAGIC_14[14];
 
-DataChunkArray format_message(std::vector<u8> const& message, u8 rmax, u8 gmax, u8 bmax, u8 amax);
-std::vector<u8> unformat_message(DataChunkArray formatted_data);
+// Receives the bytes of a message as it is extracted, a piece at a time
+using MessageSink = std::function<void(u8 const* data, size_t size)>;
+
+// Undoes format_message(...) one group of 8 chunks at a time, as the chunks are extracted
+//
+// Each group is de-conjugated as soon as its last chunk has been added, and its message bytes are
+// passed to the sink, so the formatted message never has to be stored as a whole. The size chunk
+// has to be read with read_size() before the first group is complete.
+struct MessageUnformatter {
+    MessageSink const& sink;
+    DataChunk group[8] = {};
+    size_t chunk_count = 0;
+    size_t message_size = SIZE_MAX;
+    size_t bytes_written = 0;
+
+    explicit MessageUnformatter(MessageSink const& sink) : sink(sink) {}
+
+    void add_chunk(DataChunk const& chunk);
+    void add_group(DataChunk const* chunks);
+    void unformat_group();
+    size_t read_size();
+    size_t formatted_chunk_count() const;
+    bool complete() const { return chunk_count == formatted_chunk_count(); }
+};
+
+// Does what format_message(...) does, a few groups of 8 chunks at a time
+//
+// next_chunk() hands out the chunks of the formatted message in order, formatting them as they are
+// needed, so the formatted message never has to be stored as a whole.
+struct MessageFormatter {
+    std::span<u8 const> message;
+    std::array<DataChunk, 2> magic_chunks;
+    size_t formatted_chunk_count;
+    size_t chunks_handed_out = 0;
+
+    DataChunk batch[512];
+    size_t batch_begin = 0;
+    size_t batch_size = 0;
+
+    MessageFormatter(std::span<u8 const> message, u8 rmax, u8 gmax, u8 bmax, u8 amax);
+
+    void format_chunks(size_t first_chunk, size_t count, DataChunk* chunks_out) const;
+    DataChunk const& next_chunk();
+    bool done() const { return chunks_handed_out == formatted_chunk_count; }
+};
+
+DataChunkArray format_message(std::span<u8 const> message, u8 rmax, u8 gmax, u8 bmax, u8 amax);
+std::vector<u8> unformat_message(DataChunkArray const& formatted_data);
 
 size_t calculate_formatted_message_size(size_t message_size);
+size_t parse_size_chunk(DataChunk size_chunk);
 size_t calculate_message_capacity_from_chunk_count(size_t chunk_count);
 std::array<DataChunk, 2> generate_magic_chunks(u8 rmax, u8 gmax, u8 bmax, u8 amax);
 
@@ -152,10 +447,67 @@ struct HideStats {
     size_t message_bytes_hidden;
 };
 
-HideStats bpcs_hide(float threshold, Image& img, std::vector<u8> const& message,
+HideStats bpcs_hide(float threshold, Image& img, std::span<u8 const> message,
     u8 rmax, u8 gmax, u8 bmax, u8 amax);
-std::vector<u8> bpcs_extract(Image& img);
-HideStats bpcs_measure(float threshold, Image& img, u8 rmax, u8 gmax, u8 bmax, u8 amax);
+size_t bpcs_extract(Image const& img, MessageSink const& sink);
+size_t bpcs_extract(Image const& img, u8 rmax, u8 gmax, u8 bmax, u8 amax,
+    MessageSink const& sink);
+std::vector<u8> bpcs_extract(Image const& img);
+std::vector<u8> bpcs_extract(Image const& img, u8 rmax, u8 gmax, u8 bmax, u8 amax);
+bool find_magic_chunks(Image const& img, std::array<u8, 4>& limits);
+
+// What bpcs_probe(...) finds out about a message hidden in an image, without extracting it. The
+// rest is only filled in if <found> is set, except when the magic chunks are there but the size
+// chunk is missing or doesn't have the signature. Then <corrupt_header> is set, with the bitplane
+// limits.
+struct ProbeResult {
+    bool found;
+    bool corrupt_header;
+    u8 rmax;
+    u8 gmax;
+    u8 bmax;
+    u8 amax;
+    size_t message_size;
+};
+
+ProbeResult bpcs_probe(Image const& img);
+std::array<TransitionHistogram, 32> count_transition_histograms(Image const& img,
+    std::vector<size_t> const& bitplanes, SliceKernel const& kernel = best_slice_kernel());
+HideStats bpcs_measure(float threshold, Image const& img, u8 rmax, u8 gmax, u8 bmax, u8 amax);
+
+// The capacity of an image with one combination of bitplane limits, at every threshold from 0 to
+// 0.5. message_capacity[t] is the capacity at threshold t / MAX_TRANSITIONS.
+struct CapacityTableRow {
+    u8 rmax;
+    u8 gmax;
+    u8 bmax;
+    u8 amax;
+    std::array<size_t, MESSAGE_MIN_TRANSITIONS + 1> message_capacity;
+};
+
+std::vector<CapacityTableRow> bpcs_capacity_table(Image const& img);
+
+// A message is only hidden one chunk at a time if that is expected to go through fewer chunks than
+// this fraction of the blocks (see plan_lazy_hide(...))
+#define LAZY_HIDE_MAX_BLOCK_FRACTION 4
+
+// How far below the highest reachable threshold, in transitions (11 / 112 is about 0.1), the
+// threshold chosen by choose_bitplanes(...) is allowed to go in exchange for less significant
+// bitplanes
+#define AUTO_PLANES_THRESHOLD_MARGIN 11
+
+// Bitplane limits and a threshold picked by choose_bitplanes(...)
+struct BitplaneChoice {
+    u8 rmax;
+    u8 gmax;
+    u8 bmax;
+    u8 amax;
+    float threshold;
+};
+
+BitplaneChoice choose_bitplanes(std::array<TransitionHistogram, 32> const& histograms,
+    size_t chunk_count, float threshold);
+HideStats bpcs_hide_auto_planes(float threshold, Image& img, std::span<u8 const> message);
 
 
 #endif // DECLARATIONS_202307272153
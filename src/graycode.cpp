@@ -0,0 +1,282 @@
+// Benjamin Lindley, Vanessa Martinez
+//
+// graycode.cpp
+//
+// Conversion of whole buffers of bytes to and from gray code. The conversion to gray code is a
+// single shift and XOR, but the conversion back is a prefix XOR over the bits of each byte, which
+// compilers don't reliably vectorize when written one byte at a time. So besides the scalar
+// version, which already works on 8 bytes at a time, there are explicit SSE2, AVX2 and AVX-512
+// versions, picked at runtime like the slicing kernels in bitslice.cpp.
+//
+// Hiding and extracting don't need these, since BitplaneImage does the conversion on the sliced
+// chunks instead (see binary_to_gray_code_chunks(...)).
+
+#include <algorithm>
+
+#include "declarations.h"
+
+#if STEG_X86
+#include <immintrin.h>
+#endif
+
+// Converts a single byte to gray code
+//
+// The reason for this operation is explained here: http://datahide.org/BPCSe/pbc-vs-cgc-e.html
+u8 binary_to_gray_code(u8 binary) {
+    return (binary >> 1) ^ binary;
+}
+
+// Converts a gray code byte back to plain binary
+u8 gray_code_to_binary(u8 gray_code) {
+    u8 temp = gray_code ^ (gray_code >> 4);
+    temp ^= (temp >> 2);
+    temp ^= (temp >> 1);
+    return temp;
+}
+
+// Converts 8 bytes at a time, packed in a u64. Shifting the whole word would let bits cross from
+// one byte into the next, so the masks clear the bits which came from the neighbouring byte.
+static inline u64 binary_to_gray_code_u64(u64 x) {
+    return x ^ ((x >> 1) & 0x7F7F7F7F7F7F7F7Full);
+}
+
+static inline u64 gray_code_to_binary_u64(u64 x) {
+    x ^= (x >> 4) & 0x0F0F0F0F0F0F0F0Full;
+    x ^= (x >> 2) & 0x3F3F3F3F3F3F3F3Full;
+    x ^= (x >> 1) & 0x7F7F7F7F7F7F7F7Full;
+    return x;
+}
+
+void binary_to_gray_code_scalar(u8* data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        u64 x;
+        std::memcpy(&x, data + i, 8);
+        x = binary_to_gray_code_u64(x);
+        std::memcpy(data + i, &x, 8);
+    }
+    for (; i < size; i++)
+        data[i] = binary_to_gray_code(data[i]);
+}
+
+void gray_code_to_binary_scalar(u8* data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        u64 x;
+        std::memcpy(&x, data + i, 8);
+        x = gray_code_to_binary_u64(x);
+        std::memcpy(data + i, &x, 8);
+    }
+    for (; i < size; i++)
+        data[i] = gray_code_to_binary(data[i]);
+}
+
+#if STEG_X86
+
+// There are no 8-bit shifts in SSE2 or AVX2, so these use 16-bit shifts with the same masks as the
+// scalar version. Whatever is left over at the end goes through the scalar version.
+STEG_TARGET("sse2")
+void binary_to_gray_code_sse2(u8* data, size_t size) {
+    __m128i const mask1 = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        auto ptr = (__m128i*)(data + i);
+        __m128i x = _mm_loadu_si128(ptr);
+        x = _mm_xor_si128(x, _mm_and_si128(_mm_srli_epi16(x, 1), mask1));
+        _mm_storeu_si128(ptr, x);
+    }
+    binary_to_gray_code_scalar(data + i, size - i);
+}
+
+STEG_TARGET("sse2")
+void gray_code_to_binary_sse2(u8* data, size_t size) {
+    __m128i const mask4 = _mm_set1_epi8(0x0F);
+    __m128i const mask2 = _mm_set1_epi8(0x3F);
+    __m128i const mask1 = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        auto ptr = (__m128i*)(data + i);
+        __m128i x = _mm_loadu_si128(ptr);
+        x = _mm_xor_si128(x, _mm_and_si128(_mm_srli_epi16(x, 4), mask4));
+        x = _mm_xor_si128(x, _mm_and_si128(_mm_srli_epi16(x, 2), mask2));
+        x = _mm_xor_si128(x, _mm_and_si128(_mm_srli_epi16(x, 1), mask1));
+        _mm_storeu_si128(ptr, x);
+    }
+    gray_code_to_binary_scalar(data + i, size - i);
+}
+
+STEG_TARGET("avx2")
+void binary_to_gray_code_avx2(u8* data, size_t size) {
+    __m256i const mask1 = _mm256_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto ptr = (__m256i*)(data + i);
+        __m256i x = _mm256_loadu_si256(ptr);
+        x = _mm256_xor_si256(x, _mm256_and_si256(_mm256_srli_epi16(x, 1), mask1));
+        _mm256_storeu_si256(ptr, x);
+    }
+    binary_to_gray_code_scalar(data + i, size - i);
+}
+
+STEG_TARGET("avx2")
+void gray_code_to_binary_avx2(u8* data, size_t size) {
+    __m256i const mask4 = _mm256_set1_epi8(0x0F);
+    __m256i const mask2 = _mm256_set1_epi8(0x3F);
+    __m256i const mask1 = _mm256_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto ptr = (__m256i*)(data + i);
+        __m256i x = _mm256_loadu_si256(ptr);
+        x = _mm256_xor_si256(x, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask4));
+        x = _mm256_xor_si256(x, _mm256_and_si256(_mm256_srli_epi16(x, 2), mask2));
+        x = _mm256_xor_si256(x, _mm256_and_si256(_mm256_srli_epi16(x, 1), mask1));
+        _mm256_storeu_si256(ptr, x);
+    }
+    gray_code_to_binary_scalar(data + i, size - i);
+}
+
+// AVX-512 can do the masked XOR of the shifted value in one ternary logic instruction.
+// 0x78 is a ^ (b & c).
+STEG_TARGET("avx512f,avx512bw")
+void binary_to_gray_code_avx512(u8* data, size_t size) {
+    __m512i const mask1 = _mm512_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        auto ptr = data + i;
+        __m512i x = _mm512_loadu_si512(ptr);
+        x = _mm512_ternarylogic_epi64(x, _mm512_srli_epi16(x, 1), mask1, 0x78);
+        _mm512_storeu_si512(ptr, x);
+    }
+    binary_to_gray_code_scalar(data + i, size - i);
+}
+
+STEG_TARGET("avx512f,avx512bw")
+void gray_code_to_binary_avx512(u8* data, size_t size) {
+    __m512i const mask4 = _mm512_set1_epi8(0x0F);
+    __m512i const mask2 = _mm512_set1_epi8(0x3F);
+    __m512i const mask1 = _mm512_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        auto ptr = data + i;
+        __m512i x = _mm512_loadu_si512(ptr);
+        x = _mm512_ternarylogic_epi64(x, _mm512_srli_epi16(x, 4), mask4, 0x78);
+        x = _mm512_ternarylogic_epi64(x, _mm512_srli_epi16(x, 2), mask2, 0x78);
+        x = _mm512_ternarylogic_epi64(x, _mm512_srli_epi16(x, 1), mask1, 0x78);
+        _mm512_storeu_si512(ptr, x);
+    }
+    gray_code_to_binary_scalar(data + i, size - i);
+}
+
+#endif // STEG_X86
+
+// Returns all of the gray code kernels which the processor we are running on supports, slowest
+// first
+std::vector<GrayCodeKernel> supported_gray_code_kernels() {
+    std::vector<GrayCodeKernel> kernels;
+    kernels.push_back({"scalar", binary_to_gray_code_scalar, gray_code_to_binary_scalar});
+#if STEG_X86
+    if (cpu_has_sse2())
+        kernels.push_back({"sse2", binary_to_gray_code_sse2, gray_code_to_binary_sse2});
+    if (cpu_has_avx2())
+        kernels.push_back({"avx2", binary_to_gray_code_avx2, gray_code_to_binary_avx2});
+    if (cpu_has_avx512bw())
+        kernels.push_back({"avx512", binary_to_gray_code_avx512, gray_code_to_binary_avx512});
+#endif
+    return kernels;
+}
+
+// Returns the fastest gray code kernel which the processor we are running on supports
+GrayCodeKernel const& best_gray_code_kernel() {
+    static GrayCodeKernel const kernel = supported_gray_code_kernels().back();
+    return kernel;
+}
+
+// Converts an array of bytes to gray code
+void binary_to_gray_code_inplace(std::vector<u8>& vec) {
+    best_gray_code_kernel().to_gray_code(vec.data(), vec.size());
+}
+
+// Converts an array of gray code bytes back to plain binary
+void gray_code_to_binary_inplace(std::vector<u8>& vec) {
+    best_gray_code_kernel().to_binary(vec.data(), vec.size());
+}
+
+#ifdef STEG_TEST
+
+#include <gtest/gtest.h>
+#include <bit>
+#include <chrono>
+#include <iostream>
+#include <random>
+
+size_t num_bits_diff(u8 a, u8 b) {
+    return std::popcount((u8)(a ^ b));
+}
+
+TEST(graycode, gray_code_conversions) {
+    for (int i = 0; i <= 256; i++) {
+        u8 a = (u8)i;
+        u8 b = (u8)(i + 1);
+        u8 ga = binary_to_gray_code(a);
+        u8 gb = binary_to_gray_code(b);
+        size_t diff = num_bits_diff(ga, gb);
+        ASSERT_EQ(diff, 1);
+    }
+
+    for (int i = 0; i < 256; i++) {
+        u8 a = (u8)i;
+        u8 ga = binary_to_gray_code(a);
+        u8 ba = gray_code_to_binary(ga);
+        ASSERT_EQ(a, ba);
+    }
+}
+
+TEST(graycode, kernels_match_bytewise) {
+    std::mt19937_64 gen(13579);
+    std::vector<u8> binary(1000);
+    for (auto& b : binary)
+        b = (u8)gen();
+
+    std::vector<u8> gray(binary.size());
+    std::transform(binary.begin(), binary.end(), gray.begin(), binary_to_gray_code);
+
+    // odd sizes and offsets, so that the leftovers and unaligned loads get tested too
+    for (auto& kernel : supported_gray_code_kernels()) {
+        for (size_t offset : {0, 1, 5}) {
+            for (size_t size : {0, 7, 63, 64, 200, 995}) {
+                std::vector<u8> data(binary.begin() + offset, binary.begin() + offset + size);
+                kernel.to_gray_code(data.data(), data.size());
+                ASSERT_TRUE(std::equal(data.begin(), data.end(), gray.begin() + offset))
+                    << kernel.name << " size " << size;
+
+                kernel.to_binary(data.data(), data.size());
+                ASSERT_TRUE(std::equal(data.begin(), data.end(), binary.begin() + offset))
+                    << kernel.name << " size " << size;
+            }
+        }
+    }
+}
+
+// Throughput of each kernel on a 100 megapixel rgba image. Disabled by default because of its size.
+// Run with --gtest_also_run_disabled_tests --gtest_filter=graycode.DISABLED_benchmark
+TEST(graycode, DISABLED_benchmark) {
+    std::vector<u8> data(100'000'000 * 4);
+    std::mt19937_64 gen(1);
+    for (auto& b : data)
+        b = (u8)gen();
+
+    auto gigabytes_per_second = [&](void (*fn)(u8*, size_t)) {
+        auto start = std::chrono::steady_clock::now();
+        fn(data.data(), data.size());
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        return data.size() / seconds / 1e9;
+    };
+
+    for (auto& kernel : supported_gray_code_kernels()) {
+        std::cout << kernel.name << ": to gray code " << gigabytes_per_second(kernel.to_gray_code)
+            << " GB/s, to binary " << gigabytes_per_second(kernel.to_binary) << " GB/s\n";
+    }
+}
+
+#endif // STEG_TEST
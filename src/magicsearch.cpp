@@ -0,0 +1,174 @@
+// Benjamin Lindley, Vanessa Martinez
+//
+// magicsearch.cpp
+//
+// Searches arrays of chunks for the magic chunks (see generate_magic_chunks(...)). Extraction has
+// to find them before it knows which bitplanes hold the message, and most images which get
+// searched don't have a message in them at all, so every chunk of every bitplane gets checked.
+//
+// Only the first 7 bytes of a magic chunk are fixed, so each chunk is loaded as a u64, the 8th byte
+// is masked off, and what's left is compared against both magic chunks at once. Besides the scalar
+// version, there are AVX2 and AVX-512 versions which do this for 4 and 8 chunks at a time, picked
+// at runtime like the slicing kernels in bitslice.cpp.
+
+#include <algorithm>
+
+#include "declarations.h"
+
+#if STEG_X86
+#include <immintrin.h>
+#endif
+
+// The fixed parts of the two magic chunks, as u64s in the same byte order as a chunk loaded with
+// memcpy, and the mask which leaves only those parts
+struct MagicWords {
+    u64 mask;
+    u64 magic[2];
+};
+
+static MagicWords const& magic_words() {
+    static MagicWords const words = [] {
+        MagicWords w;
+        DataChunk mask_chunk = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+        std::memcpy(&w.mask, mask_chunk.bytes, 8);
+        for (size_t i = 0; i < 2; i++) {
+            DataChunk magic_chunk = {};
+            std::memcpy(magic_chunk.bytes, MAGIC_14 + i * 7, 7);
+            std::memcpy(&w.magic[i], magic_chunk.bytes, 8);
+        }
+        return w;
+    }();
+    return words;
+}
+
+// Checks if a chunk matches either of the magic chunks
+static inline bool matches_either_magic(DataChunk const& chunk, MagicWords const& words) {
+    u64 x;
+    std::memcpy(&x, chunk.bytes, 8);
+    x &= words.mask;
+    return x == words.magic[0] || x == words.magic[1];
+}
+
+size_t find_magic_chunk_scalar(DataChunk const* chunks, size_t count) {
+    auto& words = magic_words();
+    for (size_t i = 0; i < count; i++) {
+        if (matches_either_magic(chunks[i], words))
+            return i;
+    }
+    return count;
+}
+
+#if STEG_X86
+
+// Matches are almost never found, so the comparisons of 16 chunks are combined and tested with a
+// single branch. Only when that finds something are the chunks checked one at a time.
+STEG_TARGET("avx2")
+size_t find_magic_chunk_avx2(DataChunk const* chunks, size_t count) {
+    auto& words = magic_words();
+    __m256i const mask = _mm256_set1_epi64x((long long)words.mask);
+    __m256i const magic0 = _mm256_set1_epi64x((long long)words.magic[0]);
+    __m256i const magic1 = _mm256_set1_epi64x((long long)words.magic[1]);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i any = _mm256_setzero_si256();
+        for (size_t j = 0; j < 16; j += 4) {
+            __m256i x = _mm256_and_si256(_mm256_loadu_si256((__m256i const*)chunks[i + j].bytes),
+                mask);
+            any = _mm256_or_si256(any, _mm256_cmpeq_epi64(x, magic0));
+            any = _mm256_or_si256(any, _mm256_cmpeq_epi64(x, magic1));
+        }
+        if (!_mm256_testz_si256(any, any))
+            return i + find_magic_chunk_scalar(chunks + i, 16);
+    }
+    return i + find_magic_chunk_scalar(chunks + i, count - i);
+}
+
+STEG_TARGET("avx512f")
+size_t find_magic_chunk_avx512(DataChunk const* chunks, size_t count) {
+    auto& words = magic_words();
+    __m512i const mask = _mm512_set1_epi64((long long)words.mask);
+    __m512i const magic0 = _mm512_set1_epi64((long long)words.magic[0]);
+    __m512i const magic1 = _mm512_set1_epi64((long long)words.magic[1]);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __mmask8 any = 0;
+        for (size_t j = 0; j < 32; j += 8) {
+            __m512i x = _mm512_and_si512(_mm512_loadu_si512(chunks[i + j].bytes), mask);
+            any |= _mm512_cmpeq_epi64_mask(x, magic0) | _mm512_cmpeq_epi64_mask(x, magic1);
+        }
+        if (any != 0)
+            return i + find_magic_chunk_scalar(chunks + i, 32);
+    }
+    return i + find_magic_chunk_scalar(chunks + i, count - i);
+}
+
+#endif // STEG_X86
+
+// Returns all of the magic search kernels which the processor we are running on supports, slowest
+// first
+std::vector<MagicSearchKernel> supported_magic_search_kernels() {
+    std::vector<MagicSearchKernel> kernels;
+    kernels.push_back({"scalar", find_magic_chunk_scalar});
+#if STEG_X86
+    if (cpu_has_avx2())
+        kernels.push_back({"avx2", find_magic_chunk_avx2});
+    if (cpu_has_avx512bw())
+        kernels.push_back({"avx512", find_magic_chunk_avx512});
+#endif
+    return kernels;
+}
+
+// Returns the fastest magic search kernel which the processor we are running on supports
+MagicSearchKernel const& best_magic_search_kernel() {
+    static MagicSearchKernel const kernel = supported_magic_search_kernels().back();
+    return kernel;
+}
+
+// Returns the index of the first of <count> chunks which matches either of the magic chunks, or
+// <count> if none of them do
+size_t find_magic_chunk(DataChunk const* chunks, size_t count) {
+    return best_magic_search_kernel().find_magic_chunk(chunks, count);
+}
+
+#ifdef STEG_TEST
+
+#include <gtest/gtest.h>
+#include <random>
+
+TEST(magicsearch, kernels_match_scalar) {
+    std::mt19937_64 gen(97531);
+    std::vector<DataChunk> chunks(1000);
+    for (auto& chunk : chunks) {
+        u64 value = gen();
+        std::memcpy(chunk.bytes, &value, 8);
+    }
+
+    auto magic_chunks = generate_magic_chunks(3, 1, 4, 1);
+
+    // almost magic, but not quite, so the masking gets tested
+    DataChunk near_miss = magic_chunks[0];
+    near_miss.bytes[6] ^= 1;
+    chunks[5] = near_miss;
+
+    for (auto& kernel : supported_magic_search_kernels()) {
+        ASSERT_EQ(kernel.find_magic_chunk(chunks.data(), chunks.size()), chunks.size())
+            << kernel.name;
+
+        for (size_t position : {0, 15, 16, 31, 33, 500, 999}) {
+            for (size_t m = 0; m < 2; m++) {
+                auto planted = chunks;
+                planted[position] = magic_chunks[m];
+                planted[position].bytes[7] = (u8)gen();
+                ASSERT_EQ(kernel.find_magic_chunk(planted.data(), planted.size()), position)
+                    << kernel.name;
+                ASSERT_EQ(kernel.find_magic_chunk(planted.data() + 1, planted.size() - 1),
+                    position == 0 ? planted.size() - 1 : position - 1)
+                    << kernel.name;
+            }
+        }
+    }
+}
+
+#endif // STEG_TEST
@@ -3,9 +3,11 @@
 // main.cpp
 
 
+#include <cmath>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <optional>
 #include <random>
 #include <string>
 #include <sstream>
@@ -15,6 +17,9 @@
 
 void main_impl(int argc, char** argv);
 void show_stats(HideStats const& stats, bool measure_mode);
+void show_capacity_table(std::vector<CapacityTableRow> const& table);
+void show_probe_result(ProbeResult const& result, std::string const& filename, bool json);
+void open_output_file(std::ofstream& ofstr, std::string const& filename);
 
 // Centralized location to catch all exceptions and print them
 int main(int argc, char** argv) {
@@ -40,49 +45,76 @@ int main(int argc, char** argv) {
 
 void main_impl(int argc, char** argv) {
     auto args = parse_args(argc, argv);
+    set_thread_count(args.threads);
+    set_permutation_cache_dir(args.permutation_cache_dir);
 
     if (args.help) {
         print_help(argv[0]);
     } else if (args.hide) {
         auto cover_file = Image::load(args.cover_file);
 
-        std::vector<u8> message;
+        // A message file, or standard input, is read with FileContents, which maps it if it can.
+        // A random message is made in a buffer.
+        std::vector<u8> message_buffer;
+        std::optional<FileContents> message_file;
+        std::span<u8 const> message;
         if (args.random_count >= 0) {
-            message = random_bytes(args.random_count);
+            message_buffer = random_bytes(args.random_count);
+            message = message_buffer;
         } else {
-            if (args.message_file == "-") {
-                // read message from standard input, instead of a file
-                std::string line;
-                while (std::getline(std::cin, line)) {
-                    u8 const* b = (u8*)line.data();
-                    u8 const* e = b + line.size();
-                    message.insert(message.end(), b, e);
-                    message.push_back((u8)'\n');
-                }
-            } else {
-                message = load_file(args.message_file);
-            }
+            // a message file of "-" is read from standard input
+            message_file.emplace(args.message_file, args.message_size);
+            message = message_file->bytes;
         }
 
-        auto stats = bpcs_hide(args.threshold, cover_file, message,
-            args.rmax, args.gmax, args.bmax, args.amax);
+        HideStats stats;
+        if (args.auto_planes) {
+            stats = bpcs_hide_auto_planes(args.threshold, cover_file, message);
+        } else {
+            stats = bpcs_hide(args.threshold, cover_file, message,
+                args.rmax, args.gmax, args.bmax, args.amax);
+        }
 
         cover_file.save(args.output_file);
 
         show_stats(stats, false);
     } else if (args.extract) {
         auto steg_file = Image::load(args.stego_file);
-        auto extracted_message = bpcs_extract(steg_file);
 
+        // The message is written out as it is extracted. The output file isn't opened until there
+        // is something to write to it, so it isn't left behind if there turns out to be no message.
+        std::ofstream ofstr;
+        MessageSink sink;
         if (args.output_file == "-") {
             // write message to standard output, instead of a file
-            auto data = (char const*)extracted_message.data();
-            std::cout.write(data, extracted_message.size());
+            sink = [](u8 const* data, size_t size) {
+                std::cout.write((char const*)data, size);
+            };
         } else {
-            save_file(args.output_file, extracted_message.data(), extracted_message.size());
+            sink = [&](u8 const* data, size_t size) {
+                if (!ofstr.is_open())
+                    open_output_file(ofstr, args.output_file);
+                ofstr.write((char const*)data, size);
+            };
+        }
+
+        size_t message_size = args.known_planes
+            ? bpcs_extract(steg_file, args.rmax, args.gmax, args.bmax, args.amax, sink)
+            : bpcs_extract(steg_file, sink);
+
+        if (args.output_file != "-") {
+            // an empty message still gets an empty file
+            if (!ofstr.is_open())
+                open_output_file(ofstr, args.output_file);
+            ofstr.close();
+            if (!ofstr) {
+                std::ostringstream oss;
+                oss << "error writing to " << args.output_file;
+                auto err = oss.str();
+                throw std::runtime_error(err);
+            }
 
-            std::cout << "extracted " << extracted_message.size() << " bytes to "
-                << args.output_file << '\n';
+            std::cout << "extracted " << message_size << " bytes to " << args.output_file << '\n';
         }
     } else if (args.measure) {
         auto cover_file = Image::load(args.cover_file);
@@ -90,6 +122,12 @@ void main_impl(int argc, char** argv) {
             args.rmax, args.gmax, args.bmax, args.amax);
 
         show_stats(stats, true);
+    } else if (args.capacity_table) {
+        auto cover_file = Image::load(args.cover_file);
+        show_capacity_table(bpcs_capacity_table(cover_file));
+    } else if (args.probe) {
+        auto steg_file = Image::load(args.stego_file);
+        show_probe_result(bpcs_probe(steg_file), args.stego_file, args.json);
     } else {
         auto err = "you shouldn't be here!";
         throw std::logic_error(err);
@@ -128,3 +166,86 @@ void show_stats(HideStats const& stats, bool measure_mode) {
         std::cout << '\n';
     }
 }
+
+// Prints the capacity table as CSV, one row per combination of bitplane limits and one column per
+// threshold
+void show_capacity_table(std::vector<CapacityTableRow> const& table) {
+    std::ostringstream oss;
+    oss << "rmax,gmax,bmax,amax";
+    for (size_t t = 0; t <= MESSAGE_MIN_TRANSITIONS; t++) {
+        // rounded down, so that passing the printed threshold to -t gives the same capacity
+        double threshold = std::floor((double)t / MAX_TRANSITIONS * 10000) / 10000;
+        oss << ',' << std::fixed << std::setprecision(4) << threshold;
+    }
+    oss << '\n';
+
+    for (auto& row : table) {
+        oss << (int)row.rmax << ',' << (int)row.gmax << ',' << (int)row.bmax << ','
+            << (int)row.amax;
+        for (size_t capacity : row.message_capacity)
+            oss << ',' << capacity;
+        oss << '\n';
+    }
+
+    std::cout << oss.str();
+}
+
+// Quotes a string for JSON output, escaping the characters which need it
+std::string json_string(std::string const& str) {
+    std::ostringstream oss;
+    oss << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            oss << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+        } else {
+            oss << c;
+        }
+    }
+    oss << '"';
+    return oss.str();
+}
+
+// Shows whether a message was found by probing an image, and if so, the bitplane limits it was
+// hidden with and its size, either as text or as a single line JSON object. A message whose header
+// is corrupt isn't found, but its bitplane limits are still shown.
+void show_probe_result(ProbeResult const& result, std::string const& filename, bool json) {
+    std::ostringstream oss;
+    if (json) {
+        oss << "{\"file\":" << json_string(filename)
+            << ",\"found\":" << (result.found ? "true" : "false")
+            << ",\"corrupt_header\":" << (result.corrupt_header ? "true" : "false");
+        if (result.found || result.corrupt_header) {
+            oss << ",\"rmax\":" << (int)result.rmax << ",\"gmax\":" << (int)result.gmax
+                << ",\"bmax\":" << (int)result.bmax << ",\"amax\":" << (int)result.amax;
+        }
+        if (result.found)
+            oss << ",\"message_size\":" << result.message_size;
+        oss << "}\n";
+    } else if (result.found || result.corrupt_header) {
+        if (result.found)
+            oss << "message found\n";
+        else
+            oss << "magic chunks found, but the message header is corrupt\n";
+        oss << "bitplanes (rmax, gmax, bmax, amax): " << (int)result.rmax << ", "
+            << (int)result.gmax << ", " << (int)result.bmax << ", " << (int)result.amax << '\n';
+        if (result.found)
+            oss << "message size: " << result.message_size << '\n';
+    } else {
+        oss << "no message found\n";
+    }
+
+    std::cout << oss.str();
+}
+
+// Opens a file for writing in binary mode, throwing an exception if it can't be opened
+void open_output_file(std::ofstream& ofstr, std::string const& filename) {
+    ofstr.open(filename, std::ios::binary);
+    if (!ofstr) {
+        std::ostringstream oss;
+        oss << "unable to open " << filename << " for writing";
+        auto err = oss.str();
+        throw std::runtime_error(err);
+    }
+}
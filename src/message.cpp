@@ -5,6 +5,7 @@
 // Messages can't just be copied directly. They need to be formatted with some meta data in order to
 // be able to be properly extracted. The code in this file is responsible for that formattting.
 
+#include <algorithm>
 #include <stdexcept>
 
 #include "declarations.h"
@@ -26,26 +27,48 @@ void u32_to_bytes_be(u32 value, u8* bytes_out) {
     bytes_out[3] = (u8)value;
 }
 
-// Conjugates a group of 8 chunks
+// Conjugates a chunk (see DataChunk::conjugate()) if <conjugate> is set
+//
+// Whether a message chunk needs conjugating is about as good as random, so this is done without
+// branching, by XORing the chunk with either the conjugation pattern or zero.
+static inline void conjugate_if(DataChunk& chunk, bool conjugate) {
+    DataChunk const pattern = { 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55 };
+    u64 x, mask;
+    std::memcpy(&x, chunk.bytes, 8);
+    std::memcpy(&mask, pattern.bytes, 8);
+    x ^= mask & (0 - (u64)conjugate);
+    std::memcpy(chunk.bytes, &x, 8);
+}
+
+// Conjugates <group_count> groups of 8 chunks
 //
 // We do this in groups of 8 because the conjugation map is stored in the first byte of the first
-// chunk for every group of 8
-void conjugate_group(DataChunk* chunk_ptr) {
-    u8 conj_map = 0;
-    for (size_t i = 1; i < 8; i++) {
-        conj_map <<= 1;
-        auto complexity = chunk_ptr[i].measure_complexity();
-        if (complexity < 0.5) {
-            chunk_ptr[i].conjugate();
-            conj_map |= 1;
+// chunk for every group of 8. The transitions of up to 64 groups are counted at once, because the
+// counting kernels are only worth calling for more than a few chunks.
+void conjugate_groups(DataChunk* chunk_ptr, size_t group_count) {
+    size_t const max_batch_group_count = 64;
+    u8 transitions[max_batch_group_count * 8];
+
+    for (size_t batch = 0; batch < group_count; batch += max_batch_group_count) {
+        size_t batch_group_count = std::min(max_batch_group_count, group_count - batch);
+        auto batch_ptr = chunk_ptr + batch * 8;
+        best_transition_kernel().count_transitions(batch_ptr, batch_group_count * 8, transitions);
+
+        for (size_t g = 0; g < batch_group_count; g++) {
+            auto group = batch_ptr + g * 8;
+
+            u8 conj_map = 0;
+            for (size_t i = 1; i < 8; i++) {
+                bool conjugate = transitions[g * 8 + i] < MESSAGE_MIN_TRANSITIONS;
+                conjugate_if(group[i], conjugate);
+                conj_map = (u8)((conj_map << 1) | (u8)conjugate);
+            }
+
+            // the first chunk has to be counted again, now that it holds the conjugation map
+            group[0].bytes[0] = conj_map;
+            conjugate_if(group[0], group[0].count_transitions() < MESSAGE_MIN_TRANSITIONS);
         }
     }
-
-    chunk_ptr[0].bytes[0] = conj_map;
-    auto complexity = chunk_ptr[0].measure_complexity();
-    if (complexity < 0.5) {
-        chunk_ptr[0].conjugate();
-    }
 }
 
 // Deconjugate a group of 8 chunks
@@ -55,19 +78,27 @@ void conjugate_group(DataChunk* chunk_ptr) {
 // - 0 = not conjugated
 // - 1 = conjugated
 void de_conjugate_group(DataChunk* chunk_ptr) {
-    if ((chunk_ptr[0].bytes[0] & 0x80) == 0x80) {
-        chunk_ptr[0].conjugate();
-    }
+    conjugate_if(chunk_ptr[0], (chunk_ptr[0].bytes[0] & 0x80) == 0x80);
 
     auto conj_map = chunk_ptr[0].bytes[0];
 
     for (size_t i = 1; i < 8; i++) {
-        if (conj_map & (0x80 >> i)) {
-            chunk_ptr[i].conjugate();
-        }
+        conjugate_if(chunk_ptr[i], (conj_map & (0x80 >> i)) != 0);
     }
 }
 
+// Returns the size in bytes of a formatted message (see format_message(...)), which is always a
+// whole number of groups of 8 chunks
+//
+// The 23 is the 4 bytes for storing the size, 3 magic bytes, and 16 bytes for the magic chunks. A
+// group consists of 63 bytes of the message (or meta data), plus 1 byte for the conjugation map.
+// So this rounds the size up to the nearest multiple of 63, and divides by 63 to get the number of
+// groups.
+size_t calculate_formatted_message_size(size_t message_size) {
+    size_t formatted_chunk_group_count = (23 + message_size + 62) / 63;
+    return formatted_chunk_group_count * 64;
+}
+
 // Format a message for hiding
 //
 // Several things need to be done to a message in order that we can find it again. First, we need to
@@ -85,62 +116,106 @@ void de_conjugate_group(DataChunk* chunk_ptr) {
 // first byte of every 8th chunk. For simplicity, the formatted message is extended to a multiple of
 // 8 chunks. It's possible that this could cause a message that would otherwise be able to fit, to
 // not fit, if its size is very close to the capacity of the cover image (within 63 bytes).
-DataChunkArray format_message(std::vector<u8> const& message, u8 rmax, u8 gmax, u8 bmax, u8 amax) {
-    // The message is prefixed with 3 chunks. The first chunk contains starts with the conjugation
-    // map for the first group of 8 chunks. The last 4 bytes tell us the size of the message. The 3
-    // bytes in between are another randomly generated magic number. This number is checked on
-    // extraction for validation purposes. However, this is redundant due to the magic chunks that
-    // follow. The primary purpose of the 3 magic bytes is to just fill up the first chunk to 8
-    // bytes. The conjugation map is not counted as part of the size. The second and third chunks
-    // are the magic chunks, explained elsewhere. So the 23 here is the 4 bytes for storing the
-    // size, 3 magic bytes, and 16 bytes for the magic chunks.
-    size_t formatted_size = 23 + message.size();
-
-    // This is how many groups of 8 chunks in the formatted message. A group consists of 63 bytes of
-    // the message (or meta data), plus 1 byte for the conjugation map. So this formula just rounds
-    // the size up to the nearest multiple of 63, and divides by 63 to get the number of groups.
-    size_t formatted_chunk_group_count = (formatted_size + 62) / 63;
-    size_t formatted_chunk_count = formatted_chunk_group_count * 8;
+//
+// The formatting is done by MessageFormatter, which can also hand out the formatted chunks one at a
+// time, without the whole formatted message being stored.
+DataChunkArray format_message(std::span<u8 const> message, u8 rmax, u8 gmax, u8 bmax, u8 amax) {
+    MessageFormatter formatter(message, rmax, gmax, bmax, amax);
     DataChunkArray formatted_data;
-    formatted_data.chunks.resize(formatted_chunk_count);
+    formatted_data.chunks.resize(formatter.formatted_chunk_count);
 
-    u32 message_size = (u32)message.size();
-    u8* out_ptr = formatted_data.bytes_begin();
+    // formatted a few KB at a time, so that each part is conjugated while it is still in the cache
+    size_t const batch_chunk_count = std::size(formatter.batch);
+    for (size_t i = 0; i < formatter.formatted_chunk_count; i += batch_chunk_count) {
+        size_t count = std::min(batch_chunk_count, formatter.formatted_chunk_count - i);
+        formatter.format_chunks(i, count, formatted_data.chunks.data() + i);
+    }
 
-    std::memcpy(out_ptr + 1, SIGNATURE, 3);
-    u32_to_bytes_be(message_size, out_ptr + 4);
+    return formatted_data;
+}
 
-    auto magic_chunks = generate_magic_chunks(rmax, gmax, bmax, amax);
-    formatted_data.chunks[1] = magic_chunks[0];
-    formatted_data.chunks[2] = magic_chunks[1];
+MessageFormatter::MessageFormatter(std::span<u8 const> message,
+    u8 rmax, u8 gmax, u8 bmax, u8 amax)
+    : message(message),
+    magic_chunks(generate_magic_chunks(rmax, gmax, bmax, amax)),
+    formatted_chunk_count(calculate_formatted_message_size(message.size()) / 8)
+{}
 
-    // start outputting the actual message at the 3rd chunk (24th byte)
-    size_t out_index = 3 * 8;
-    size_t in_index = 0;
+// Formats <count> chunks of the message, starting at chunk <first_chunk>, into <chunks_out>. Both
+// have to be multiples of 8, so that only whole groups are formatted.
+//
+// The message is prefixed with 3 chunks. The first chunk contains starts with the conjugation map
+// for the first group of 8 chunks. The last 4 bytes tell us the size of the message. The 3 bytes in
+// between are another randomly generated magic number. This number is checked on extraction for
+// validation purposes. However, this is redundant due to the magic chunks that follow. The primary
+// purpose of the 3 magic bytes is to just fill up the first chunk to 8 bytes. The conjugation map
+// is not counted as part of the size. The second and third chunks are the magic chunks, explained
+// elsewhere. That makes 23 bytes of meta data (see calculate_formatted_message_size(...)).
+void MessageFormatter::format_chunks(size_t first_chunk, size_t count,
+    DataChunk* chunks_out) const
+{
+    if (first_chunk % 8 || count % 8 || first_chunk + count > formatted_chunk_count) {
+        auto err = "chunks not multiple of 8, fix this";
+        throw std::logic_error(err);
+    }
 
-    while (in_index < message.size()) {
-        // skip over the conjugation byte
-        if (out_index % 64 == 0) {
-            out_index++;
+    // The message is copied a group at a time, after the conjugation byte at the start of each. The
+    // first group only has room for 40 bytes, after the 3rd chunk (24th byte), and every other
+    // group has room for 63. Whatever is left over at the end of the last group is zero.
+    for (size_t i = 0; i < count; i += 8) {
+        size_t group_index = (first_chunk + i) / 8;
+        u8* group_ptr = chunks_out[i].bytes;
+
+        size_t group_begin = group_index == 0 ? 24 : 1;
+        size_t in_index = group_index == 0 ? 0 : 40 + (group_index - 1) * 63;
+        size_t size = in_index < message.size()
+            ? std::min(64 - group_begin, message.size() - in_index)
+            : 0;
+
+        group_ptr[0] = 0;
+        if (size > 0)
+            std::memcpy(group_ptr + group_begin, message.data() + in_index, size);
+        std::memset(group_ptr + group_begin + size, 0, 64 - group_begin - size);
+
+        if (group_index == 0) {
+            std::memcpy(group_ptr + 1, SIGNATURE, 3);
+            u32_to_bytes_be((u32)message.size(), group_ptr + 4);
+            chunks_out[i + 1] = magic_chunks[0];
+            chunks_out[i + 2] = magic_chunks[1];
         }
-
-        out_ptr[out_index] = message[in_index];
-        ++out_index;
-        ++in_index;
     }
 
-    if (formatted_data.chunks.size() % 8) {
-        auto err = "chunks not multiple of 8, fix this";
+    conjugate_groups(chunks_out, count / 8);
+}
+
+// Returns the next chunk of the formatted message, formatting the next few KB of it if needed
+DataChunk const& MessageFormatter::next_chunk() {
+    if (chunks_handed_out == formatted_chunk_count) {
+        auto err = "no formatted chunks left";
         throw std::logic_error(err);
     }
 
-    for (size_t i = 0; i < formatted_data.chunks.size(); i += 8) {
-        conjugate_group(formatted_data.chunks.data() + i);
+    if (chunks_handed_out == batch_begin + batch_size) {
+        batch_begin = chunks_handed_out;
+        batch_size = std::min(std::size(batch), formatted_chunk_count - batch_begin);
+        format_chunks(batch_begin, batch_size, batch);
     }
 
-    return formatted_data;
+    return batch[chunks_handed_out++ - batch_begin];
 }
 
+// Returns the size of the largest message which fits in the given number of formatted chunks
+//
+// Only whole groups of 8 chunks can be used, each holding 63 bytes, and the first 23 of those bytes
+// are taken up by the size, signature and magic chunks (see format_message(...)).
+size_t calculate_message_capacity_from_chunk_count(size_t chunk_count) {
+    size_t formatted_message_size = chunk_count / 8 * 63;
+    if (formatted_message_size < 23)
+        return 0;
+    return formatted_message_size - 23;
+}
+
+// Reads the message size from the first chunk of a formatted message, checking the signature
 size_t parse_size_chunk(DataChunk size_chunk) {
     if ((size_chunk.bytes[0] & 0x80) == 0x80)
         size_chunk.conjugate();
@@ -149,36 +224,94 @@ size_t parse_size_chunk(DataChunk size_chunk) {
     return (size_t)u32_from_bytes_be(size_chunk.bytes + 4);
 }
 
+// Adds the next chunk of a formatted message, and if that completes a group of 8, de-conjugates the
+// group and passes its message bytes to the sink
+//
+// Every group holds 63 bytes after its conjugation map, except the first, which holds 40 after the
+// size chunk and magic chunks. Only as many as are left of the message are passed on.
+void MessageUnformatter::add_chunk(DataChunk const& chunk) {
+    group[chunk_count % 8] = chunk;
+    chunk_count++;
+    if (chunk_count % 8 == 0)
+        unformat_group();
+}
+
+// Adds the next 8 chunks of a formatted message at once, which have to make up a whole group
+void MessageUnformatter::add_group(DataChunk const* chunks) {
+    if (chunk_count % 8 != 0) {
+        auto err = "group added part way through a group";
+        throw std::logic_error(err);
+    }
+    std::memcpy(group, chunks, sizeof(group));
+    chunk_count += 8;
+    unformat_group();
+}
+
+// De-conjugates the group which has just been completed, and passes its message bytes to the sink
+void MessageUnformatter::unformat_group() {
+    if (message_size == SIZE_MAX) {
+        auto err = "message size not read before the end of the first group";
+        throw std::logic_error(err);
+    }
+
+    de_conjugate_group(group);
+
+    size_t group_begin = chunk_count == 8 ? 24 : 1;
+    size_t size = std::min(64 - group_begin, message_size - bytes_written);
+    if (size > 0)
+        sink(group[0].bytes + group_begin, size);
+    bytes_written += size;
+}
+
+// Reads the message size from the first chunk, which has to have been added, and returns the number
+// of chunks in the formatted message
+size_t MessageUnformatter::read_size() {
+    if (chunk_count == 0 || chunk_count >= 8) {
+        auto err = "message size read without the first chunk";
+        throw std::logic_error(err);
+    }
+    message_size = parse_size_chunk(group[0]);
+    return formatted_chunk_count();
+}
+
+// Returns the number of chunks in the formatted message, or SIZE_MAX if the size hasn't been read
+size_t MessageUnformatter::formatted_chunk_count() const {
+    if (message_size == SIZE_MAX)
+        return SIZE_MAX;
+    return calculate_formatted_message_size(message_size) / 8;
+}
+
 // Undoes what format_message(...) did.
 //
 // Unconjugates conjugated chunks, extracts size, checks signature, and returns message in its
-// original form.
-std::vector<u8> unformat_message(DataChunkArray formatted_data) {
+// original form. Only whole groups of 8 chunks are unformatted, so if the size says there is more
+// message than there are chunks, the message is cut short. The message is copied out a group at a
+// time, into space reserved for all of it up front.
+std::vector<u8> unformat_message(DataChunkArray const& formatted_data) {
     std::vector<u8> message;
     if (formatted_data.chunks.size() < 8) {
         return message;
     }
 
-    size_t parsed_message_size = parse_size_chunk(formatted_data.chunks[0]);
-    size_t num_chunk_groups = formatted_data.chunks.size() / 8;
-    size_t formatted_message_size = num_chunk_groups * 63;
-    size_t max_possible_message_size = formatted_message_size - 23;
-    size_t actual_message_size = std::min(parsed_message_size, max_possible_message_size);
+    MessageSink sink = [&](u8 const* data, size_t size) {
+        message.insert(message.end(), data, data + size);
+    };
+    MessageUnformatter unformatter(sink);
 
-    for (size_t i = 0; i < num_chunk_groups; i++) {
-        auto chunk_ptr = formatted_data.chunks.data() + i * 8;
-        de_conjugate_group(chunk_ptr);
-    }
+    // the size has to be read before the first group is complete, so its chunks are added one at a
+    // time
+    unformatter.add_chunk(formatted_data.chunks[0]);
+    unformatter.read_size();
+    for (size_t i = 1; i < 8; i++)
+        unformatter.add_chunk(formatted_data.chunks[i]);
 
-    size_t formatted_data_index = 24;
-    auto formatted_data_byte_ptr = formatted_data.bytes_begin();
-    message.reserve(actual_message_size);
-    for (size_t i = 0; i < actual_message_size; i++) {
-        if (formatted_data_index % 64 == 0)
-            ++formatted_data_index;
-        message.push_back(formatted_data_byte_ptr[formatted_data_index]);
-        ++formatted_data_index;
-    }
+    size_t max_possible_message_size =
+        calculate_message_capacity_from_chunk_count(formatted_data.chunks.size());
+    message.reserve(std::min(unformatter.message_size, max_possible_message_size));
+
+    auto chunks = formatted_data.chunks.data();
+    for (size_t i = 8; i + 8 <= formatted_data.chunks.size() && !unformatter.complete(); i += 8)
+        unformatter.add_group(chunks + i);
 
     return message;
 }
@@ -199,4 +332,37 @@ TEST(message, message_formatting) {
     ASSERT_EQ(message, recovered_message);
 }
 
+TEST(message, group_boundaries) {
+    // the first group holds 40 bytes of the message and every other group 63, so these sizes are
+    // just short of, at, and just past the end of a group
+    for (size_t size : {0, 1, 39, 40, 41, 102, 103, 104, 166, 1000}) {
+        std::vector<u8> message(size);
+        for (size_t i = 0; i < size; i++)
+            message[i] = (u8)(i * 37 + 11);
+
+        auto formatted_message = format_message(message, 1, 2, 3, 4);
+        ASSERT_EQ(formatted_message.chunks.size(), calculate_formatted_message_size(size) / 8);
+        for (auto& chunk : formatted_message.chunks)
+            ASSERT_GE(chunk.count_transitions(), MESSAGE_MIN_TRANSITIONS);
+
+        ASSERT_EQ(unformat_message(formatted_message), message) << "size " << size;
+    }
+}
+
+TEST(message, formatter_matches_format_message) {
+    // big enough to take several batches of the formatter
+    std::vector<u8> message(100000);
+    for (size_t i = 0; i < message.size(); i++)
+        message[i] = (u8)(std::rand() >> 7);
+
+    auto formatted_message = format_message(message, 8, 7, 6, 5);
+    MessageFormatter formatter(message, 8, 7, 6, 5);
+    ASSERT_EQ(formatter.formatted_chunk_count, formatted_message.chunks.size());
+    for (auto& chunk : formatted_message.chunks) {
+        ASSERT_FALSE(formatter.done());
+        ASSERT_EQ(formatter.next_chunk(), chunk);
+    }
+    ASSERT_TRUE(formatter.done());
+}
+
 #endif // STEG_TEST
@@ -0,0 +1,382 @@
+// Benjamin Lindley, Vanessa Martinez
+//
+// permutation.cpp
+//
+// Generates the random order in which the chunks of each bitplane are used for hiding, and caches
+// it per image size.
+//
+// The chunks of every bitplane used to be shuffled separately, with a Fisher-Yates shuffle seeded
+// from the image dimensions. But the shuffle was always handed a fresh copy of the same random
+// number generator, so every bitplane's shuffle performed the exact same sequence of swaps. That
+// means each bitplane's order is just the previous bitplane's order, rearranged by one fixed
+// permutation. We call that permutation the chunk shuffle. It only has to be generated once per
+// image size, and every bitplane's order can be built from it with a simple gather, which gives
+// results identical to the original 32 shuffles.
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "declarations.h"
+
+// Generates the chunk shuffle for an image of the given size, without using the cache
+//
+// Returns the result of shuffling the list 0, 1, 2, ... (one entry per 8x8 block) with the original
+// Fisher-Yates shuffle. The random numbers are drawn in batches, so that the generator's loop and
+// the swapping loop each stay tight.
+std::vector<u32> generate_chunk_shuffle(size_t width, size_t height) {
+    size_t chunks_per_bitplane = (width / 8) * (height / 8);
+
+    std::vector<u32> shuffle(chunks_per_bitplane);
+    for (size_t i = 0; i < chunks_per_bitplane; i++)
+        shuffle[i] = (u32)i;
+
+    // Unlike the C rand() function, the random number generators provided in the C++ <random>
+    // header are guaranteed to be reproducible for any particular seed across all standard
+    // compliant platforms. This is potentially a good place to introduce some encryption, by using
+    // the password to modify the seed.
+    u64 seed = width * 1000003 + height;
+    std::mt19937_64 gen(seed);
+
+    u64 draws[512];
+    size_t i = 0;
+    while (i + 1 < chunks_per_bitplane) {
+        size_t batch_size = std::min(std::size(draws), chunks_per_bitplane - 1 - i);
+        for (size_t j = 0; j < batch_size; j++)
+            draws[j] = gen();
+
+        for (size_t j = 0; j < batch_size; j++, i++) {
+            u64 remaining = chunks_per_bitplane - i;
+            size_t swap_index = (size_t)(draws[j] % remaining);
+            if (swap_index != 0)
+                std::swap(shuffle[i], shuffle[i + swap_index]);
+        }
+    }
+
+    return shuffle;
+}
+
+// The chunk shuffles which have already been generated, so that a batch of images of the same size
+// only pays for it once. If <directory> is set, they are also saved to and loaded from files there.
+struct PermutationCache {
+    std::mutex mutex;
+    std::string directory;
+    std::map<std::pair<size_t, size_t>, std::shared_ptr<std::vector<u32> const>> shuffles;
+};
+
+static PermutationCache permutation_cache;
+
+static u8 const PERMUTATION_FILE_MAGIC[8] = { 'S', 'T', 'E', 'G', 'P', 'E', 'R', 'M' };
+
+// The file a chunk shuffle is stored in. Everything in the file is little-endian: the magic bytes,
+// the width, height and chunk count as u64s, and then the shuffle as u32s.
+static std::string permutation_file_name(std::string const& directory,
+    size_t width, size_t height)
+{
+    std::ostringstream oss;
+    oss << "steg_perm_" << width << 'x' << height << ".bin";
+    return (std::filesystem::path(directory) / oss.str()).string();
+}
+
+static void append_le(std::vector<u8>& data, u64 value, size_t byte_count) {
+    for (size_t i = 0; i < byte_count; i++)
+        data.push_back((u8)(value >> (i * 8)));
+}
+
+static u64 read_le(u8 const* bytes, size_t byte_count) {
+    u64 value = 0;
+    for (size_t i = 0; i < byte_count; i++)
+        value |= (u64)bytes[i] << (i * 8);
+    return value;
+}
+
+static void save_chunk_shuffle(std::string const& filename, size_t width, size_t height,
+    std::vector<u32> const& shuffle)
+{
+    std::vector<u8> data(PERMUTATION_FILE_MAGIC, PERMUTATION_FILE_MAGIC + 8);
+    data.reserve(32 + shuffle.size() * 4);
+    append_le(data, width, 8);
+    append_le(data, height, 8);
+    append_le(data, shuffle.size(), 8);
+    for (u32 value : shuffle)
+        append_le(data, value, 4);
+
+    save_file(filename, data);
+}
+
+// Loads a chunk shuffle saved by save_chunk_shuffle(...). Returns an empty pointer if the file
+// doesn't exist or isn't a valid shuffle for this image size, in which case it will be regenerated.
+static std::shared_ptr<std::vector<u32> const> load_chunk_shuffle(std::string const& filename,
+    size_t width, size_t height)
+{
+    if (!std::filesystem::exists(filename))
+        return nullptr;
+
+    auto data = load_file(filename);
+    size_t chunks_per_bitplane = (width / 8) * (height / 8);
+    if (data.size() != 32 + chunks_per_bitplane * 4
+        || std::memcmp(data.data(), PERMUTATION_FILE_MAGIC, 8) != 0
+        || read_le(data.data() + 8, 8) != width
+        || read_le(data.data() + 16, 8) != height
+        || read_le(data.data() + 24, 8) != chunks_per_bitplane)
+    {
+        return nullptr;
+    }
+
+    auto shuffle = std::make_shared<std::vector<u32>>(chunks_per_bitplane);
+    std::vector<bool> seen(chunks_per_bitplane);
+    for (size_t i = 0; i < chunks_per_bitplane; i++) {
+        u32 value = (u32)read_le(data.data() + 32 + i * 4, 4);
+        if (value >= chunks_per_bitplane || seen[value])
+            return nullptr;
+        seen[value] = true;
+        (*shuffle)[i] = value;
+    }
+
+    return shuffle;
+}
+
+// Sets a directory in which chunk shuffles are saved, so that later runs on images of the same
+// size can load them instead of generating them. An empty string turns this off.
+void set_permutation_cache_dir(std::string const& directory) {
+    std::lock_guard<std::mutex> lock(permutation_cache.mutex);
+    permutation_cache.directory = directory;
+}
+
+// Forgets all of the chunk shuffles held in memory
+void clear_permutation_cache() {
+    std::lock_guard<std::mutex> lock(permutation_cache.mutex);
+    permutation_cache.shuffles.clear();
+}
+
+// Returns the chunk shuffle for an image of the given size
+//
+// Looks in memory first, then in the cache directory if there is one, and only generates it if
+// neither has it.
+//
+// The cache directory is only an optimization, so failing to read or write a file in it never stops
+// anything. The file is written after the lock is released, so other threads aren't held up by it.
+std::shared_ptr<std::vector<u32> const> get_chunk_shuffle(size_t width, size_t height) {
+    std::unique_lock<std::mutex> lock(permutation_cache.mutex);
+
+    auto key = std::make_pair(width, height);
+    auto it = permutation_cache.shuffles.find(key);
+    if (it != permutation_cache.shuffles.end())
+        return it->second;
+
+    std::shared_ptr<std::vector<u32> const> shuffle;
+    std::string filename;
+    if (!permutation_cache.directory.empty()) {
+        filename = permutation_file_name(permutation_cache.directory, width, height);
+        try {
+            shuffle = load_chunk_shuffle(filename, width, height);
+        } catch (std::exception const&) {}
+    }
+
+    bool generated = !shuffle;
+    if (generated)
+        shuffle = std::make_shared<std::vector<u32> const>(generate_chunk_shuffle(width, height));
+
+    permutation_cache.shuffles[key] = shuffle;
+    lock.unlock();
+
+    if (generated && !filename.empty()) {
+        try {
+            std::filesystem::create_directories(std::filesystem::path(filename).parent_path());
+            save_chunk_shuffle(filename, width, height, *shuffle);
+        } catch (std::exception const&) {}
+    }
+
+    return shuffle;
+}
+
+// Calls <op> for each of the given bitplanes, with the order in which that bitplane's chunks are
+// used for hiding
+//
+// chunk_priority[ci] is the index of the 8x8 block of the image whose chunk comes at position ci of
+// the bitplane's order. Blocks are indexed left to right, top to bottom. <op> also receives the
+// position of the bitplane in <bitplanes>. Hiding and extracting need the exact same sequence of
+// orderings, so it is generated in only this one place.
+void for_each_chunk_priority(size_t width, size_t height, std::vector<size_t> const& bitplanes,
+    ChunkPriorityOp const& op)
+{
+    size_t chunks_per_bitplane = (width / 8) * (height / 8);
+
+    // The order of each bitplane is the order of the previous one, rearranged by the chunk shuffle.
+    // So every bitplane up to the last one requested has to be visited, even the ones which were
+    // not requested. The order is different for each bitplane. This probably
+    // doesn't do anything to help with detectability, but perhaps it makes extraction harder.
+    auto shuffle = get_chunk_shuffle(width, height);
+
+    size_t position_of_bitplane[32];
+    size_t bitplane_end = 0;
+    std::fill(std::begin(position_of_bitplane), std::end(position_of_bitplane), SIZE_MAX);
+    for (size_t i = 0; i < bitplanes.size(); i++) {
+        position_of_bitplane[bitplanes[i]] = i;
+        bitplane_end = std::max(bitplane_end, bitplanes[i] + 1);
+    }
+
+    std::vector<u32> chunk_priority(chunks_per_bitplane);
+    std::vector<u32> previous_priority(chunks_per_bitplane);
+    for (size_t i = 0; i < chunks_per_bitplane; i++)
+        chunk_priority[i] = (u32)i;
+
+    for (size_t bitplane_index = 0; bitplane_index < bitplane_end; bitplane_index++) {
+        chunk_priority.swap(previous_priority);
+        parallel_for(chunks_per_bitplane, [&](size_t ci_begin, size_t ci_end) {
+            for (size_t ci = ci_begin; ci < ci_end; ci++)
+                chunk_priority[ci] = previous_priority[(*shuffle)[ci]];
+        });
+
+        if (position_of_bitplane[bitplane_index] != SIZE_MAX)
+            op(bitplane_index, position_of_bitplane[bitplane_index], chunk_priority);
+    }
+}
+
+// Writes the block indices at positions <position> to <position> + <count> - 1 of a bitplane's
+// order to <block_indices_out>, the same as chunk_priority[ci] in for_each_chunk_priority(...),
+// without building the whole order
+//
+// Since each bitplane's order is the previous one rearranged by the chunk shuffle, and the orders
+// start from the identity, the order of bitplane b is just the chunk shuffle applied b + 1 times.
+// That's up to 32 lookups per position, each depending on the one before, which is only worth it
+// when a few positions are needed. The positions are stepped through the shuffle together, so
+// that the lookups for different positions can overlap.
+void chunk_priority_range(std::vector<u32> const& shuffle, size_t bitplane_index,
+    size_t position, size_t count, u32* block_indices_out)
+{
+    for (size_t i = 0; i < count; i++)
+        block_indices_out[i] = (u32)(position + i);
+
+    for (size_t step = 0; step <= bitplane_index; step++) {
+        for (size_t i = 0; i < count; i++)
+            block_indices_out[i] = shuffle[block_indices_out[i]];
+    }
+}
+
+#ifdef STEG_TEST
+
+#include <gtest/gtest.h>
+
+// The original shuffle, which chunkify used to call once per bitplane, always with a copy of the
+// same generator
+template<typename It, typename Gen>
+void fisher_yates_shuffle(It begin, It end, Gen gen) {
+    auto n = std::distance(begin, end);
+    while (n > 1) {
+        auto swap_index = gen() % n;
+        if (swap_index != 0) {
+            std::iter_swap(begin, std::next(begin, swap_index));
+        }
+        ++begin;
+        --n;
+    }
+}
+
+TEST(permutation, matches_original_shuffle) {
+    size_t const sizes[][2] = { {0, 0}, {8, 8}, {16, 8}, {257, 135}, {1000, 600} };
+    for (auto& size : sizes) {
+        size_t width = size[0];
+        size_t height = size[1];
+        size_t chunks_per_bitplane = (width / 8) * (height / 8);
+
+        std::mt19937_64 gen(width * 1000003 + height);
+        std::vector<size_t> expected(chunks_per_bitplane);
+        for (size_t i = 0; i < chunks_per_bitplane; i++)
+            expected[i] = i;
+
+        auto shuffle = generate_chunk_shuffle(width, height);
+        std::vector<u32> order(shuffle.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = (u32)i;
+
+        for (size_t bitplane_index = 0; bitplane_index < 32; bitplane_index++) {
+            fisher_yates_shuffle(expected.begin(), expected.end(), gen);
+
+            std::vector<u32> next_order(order.size());
+            for (size_t i = 0; i < order.size(); i++)
+                next_order[i] = order[shuffle[i]];
+            order = next_order;
+
+            ASSERT_TRUE(std::equal(order.begin(), order.end(), expected.begin(), expected.end()));
+        }
+    }
+}
+
+TEST(permutation, chunk_priority_range) {
+    size_t width = 257;
+    size_t height = 135;
+    auto shuffle = get_chunk_shuffle(width, height);
+
+    std::vector<size_t> bitplanes = { 7, 0, 31, 12 };
+    for_each_chunk_priority(width, height, bitplanes,
+        [&](size_t bitplane_index, size_t, std::vector<u32> const& chunk_priority) {
+            for (size_t ci = 0; ci < chunk_priority.size(); ci += 37) {
+                size_t count = std::min<size_t>(37, chunk_priority.size() - ci);
+                u32 block_indices[37];
+                chunk_priority_range(*shuffle, bitplane_index, ci, count, block_indices);
+                ASSERT_TRUE(std::equal(block_indices, block_indices + count,
+                    chunk_priority.begin() + ci));
+            }
+        });
+}
+
+TEST(permutation, cache_directory) {
+    auto directory = std::filesystem::temp_directory_path() / "steg_permutation_cache_test";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    set_permutation_cache_dir(directory.string());
+    clear_permutation_cache();
+    auto generated = get_chunk_shuffle(320, 200);
+    ASSERT_EQ(*generated, generate_chunk_shuffle(320, 200));
+    ASSERT_EQ(get_chunk_shuffle(320, 200), generated);
+
+    // Forget the in memory copy, so that it has to come from the file
+    clear_permutation_cache();
+    auto loaded = get_chunk_shuffle(320, 200);
+    ASSERT_NE(loaded, generated);
+    ASSERT_EQ(*loaded, *generated);
+
+    // A corrupt file is ignored and regenerated
+    save_file(permutation_file_name(directory.string(), 320, 200), std::vector<u8>(40, 7));
+    clear_permutation_cache();
+    ASSERT_EQ(*get_chunk_shuffle(320, 200), *generated);
+
+    set_permutation_cache_dir("");
+    clear_permutation_cache();
+    std::filesystem::remove_all(directory);
+}
+
+TEST(permutation, unwritable_cache_directory) {
+    // A regular file where the cache directory should be, so that nothing can be saved in it
+    auto blocker = std::filesystem::temp_directory_path() / "steg_permutation_cache_blocker";
+    std::filesystem::remove_all(blocker);
+    save_file(blocker.string(), std::vector<u8>(1));
+
+    set_permutation_cache_dir((blocker / "cache").string());
+    clear_permutation_cache();
+    ASSERT_EQ(*get_chunk_shuffle(320, 200), generate_chunk_shuffle(320, 200));
+
+    // hiding and extracting still work, they just don't get to reuse the chunk shuffle next time
+    Image img = { 96, 64, std::vector<u8>(96 * 64 * 4) };
+    std::mt19937_64 gen(1234);
+    for (auto& value : img.pixel_data)
+        value = (u8)gen();
+    std::vector<u8> message(100, 0x42);
+    clear_permutation_cache();
+    bpcs_hide(-1.0f, img, message, 2, 2, 2, 2);
+    clear_permutation_cache();
+    ASSERT_EQ(bpcs_extract(img), message);
+
+    set_permutation_cache_dir("");
+    clear_permutation_cache();
+    std::filesystem::remove_all(blocker);
+}
+
+#endif // STEG_TEST
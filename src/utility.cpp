@@ -4,13 +4,40 @@
 //
 // General purpose functions that don't really belong to any specific module.
 
+#include <algorithm>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <random>
 #include <sstream>
+#include <thread>
 
 #include "declarations.h"
 
+#if STEG_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#if STEG_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // Treats an array of bytes as an array of bits, and retrieves a bit by its index
 //
 // Bit index 0 is the MSB of the first byte. Bit index 7 is the LSB of the first byte. Bit 8 is
@@ -113,6 +140,172 @@ std::vector<u8> load_file(std::string const& filename) {
     return data;
 }
 
+// Reads until the end, in large blocks, into <buffer>, setting <size> to the number of bytes read
+//
+// <read_some> reads up to <count> bytes to <data>, and returns how many it read, 0 at the end, or a
+// negative number if the read fails, in which case this returns false. The size might not be known
+// up front, so <size_hint> is only where the buffer starts (with room to see the end without
+// growing), and it is doubled whenever it fills up. The buffer is allocated with malloc, so that
+// the bytes aren't zero filled before being read over, and growing a large buffer with realloc can
+// usually just remap its pages instead of copying them. It is shrunk to fit once at the end.
+template<typename ReadSome>
+static bool read_until_end(ReadSome const& read_some, size_t size_hint, MallocBuffer& buffer,
+    size_t& size)
+{
+    size_t capacity = std::max(size_hint + 1, (size_t)1 << 20);
+    buffer.reset((u8*)std::malloc(capacity));
+    if (!buffer)
+        throw std::bad_alloc();
+
+    size = 0;
+    while (true) {
+        if (size == capacity) {
+            auto grown = (u8*)std::realloc(buffer.get(), capacity * 2);
+            if (!grown)
+                throw std::bad_alloc();
+            buffer.release();
+            buffer.reset(grown);
+            capacity *= 2;
+        }
+
+        auto count = read_some(buffer.get() + size, capacity - size);
+        if (count == 0)
+            break;
+        if (count < 0)
+            return false;
+        size += (size_t)count;
+    }
+
+    // shrinking in place never fails in practice, but if it does, the bigger buffer still works
+    if (auto shrunk = (u8*)std::realloc(buffer.get(), std::max<size_t>(size, 1))) {
+        buffer.release();
+        buffer.reset(shrunk);
+    }
+    return true;
+}
+
+// Opens a file and gets its contents, memory mapping it if it is a regular file. A filename of "-"
+// reads standard input, as binary. <size_hint> is the expected size of something which can't be
+// mapped, if known, so that the buffer can be allocated once up front. Anything larger is still
+// read, just with the buffer growing.
+FileContents::FileContents(std::string const& filename, size_t size_hint) {
+    std::string name = filename == "-" ? "standard input" : filename;
+    size_t size = 0;
+    bool read_ok;
+
+#if STEG_POSIX
+    auto read_fd = [](int fd) {
+        return [fd](u8* data, size_t count) {
+            while (true) {
+                auto n = read(fd, data, count);
+                if (n >= 0 || errno != EINTR)
+                    return n;
+            }
+        };
+    };
+
+    if (filename == "-") {
+        struct stat st;
+        if (fstat(STDIN_FILENO, &st) == 0) {
+            if (S_ISREG(st.st_mode) && size_hint == 0) {
+                // redirected from a file, so what's left of it is the size
+                auto position = lseek(STDIN_FILENO, 0, SEEK_CUR);
+                if (position >= 0 && position < st.st_size)
+                    size_hint = (size_t)(st.st_size - position);
+            }
+#ifdef F_SETPIPE_SZ
+            // A bigger pipe means the writer gets further ahead, and each read() gets more. This
+            // is only a request, which is limited by /proc/sys/fs/pipe-max-size, so failure is
+            // fine.
+            if (S_ISFIFO(st.st_mode))
+                fcntl(STDIN_FILENO, F_SETPIPE_SZ, 1 << 20);
+#endif
+        }
+        read_ok = read_until_end(read_fd(STDIN_FILENO), size_hint, buffer, size);
+    } else {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::ostringstream oss;
+            oss << "unable to open " << filename;
+            auto err = oss.str();
+            throw std::runtime_error(err);
+        }
+
+        struct stat st;
+        bool is_regular_file = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (is_regular_file && st.st_size > 0) {
+            void* ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                // the message is read from front to back, so the kernel can read ahead
+                madvise(ptr, (size_t)st.st_size, MADV_SEQUENTIAL);
+                close(fd);
+                mapping = ptr;
+                mapping_size = (size_t)st.st_size;
+                bytes = { (u8 const*)ptr, mapping_size };
+                return;
+            }
+        }
+
+        // anything which can't be mapped is read into the buffer instead
+        if (is_regular_file)
+            size_hint = (size_t)st.st_size;
+        try {
+            read_ok = read_until_end(read_fd(fd), size_hint, buffer, size);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+#else
+    auto read_file = [](std::FILE* file) {
+        return [file](u8* data, size_t count) {
+            size_t n = std::fread(data, 1, count, file);
+            return n == 0 && std::ferror(file) ? (ptrdiff_t)-1 : (ptrdiff_t)n;
+        };
+    };
+
+    if (filename == "-") {
+#ifdef _WIN32
+        // standard input is opened in text mode, which would mangle line endings and stop at ^Z
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        read_ok = read_until_end(read_file(stdin), size_hint, buffer, size);
+    } else {
+        std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(
+            std::fopen(filename.c_str(), "rb"), std::fclose);
+        if (!file) {
+            std::ostringstream oss;
+            oss << "unable to open " << filename;
+            auto err = oss.str();
+            throw std::runtime_error(err);
+        }
+        if (std::fseek(file.get(), 0, SEEK_END) == 0) {
+            auto file_size = std::ftell(file.get());
+            if (file_size > 0)
+                size_hint = (size_t)file_size;
+            std::fseek(file.get(), 0, SEEK_SET);
+        }
+        read_ok = read_until_end(read_file(file.get()), size_hint, buffer, size);
+    }
+#endif
+
+    if (!read_ok) {
+        std::ostringstream oss;
+        oss << "error reading " << name;
+        auto err = oss.str();
+        throw std::runtime_error(err);
+    }
+    bytes = { buffer.get(), size };
+}
+
+FileContents::~FileContents() {
+#if STEG_POSIX
+    if (mapping)
+        munmap(mapping, mapping_size);
+#endif
+}
+
 // Creates a vector of random bytes
 std::vector<u8> random_bytes(size_t size) {
     std::mt19937_64 gen;
@@ -123,6 +316,194 @@ std::vector<u8> random_bytes(size_t size) {
     return v;
 }
 
+#if STEG_X86 && defined(_MSC_VER)
+// MSVC has no equivalent of __builtin_cpu_supports, so we query cpuid ourselves. An instruction
+// set is only usable if the operating system also saves the registers it uses on a context switch,
+// which is what the xgetbv check is for.
+static bool msvc_cpu_has(int leaf, int reg, int bit, u64 xcr0_mask) {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < leaf)
+        return false;
+    __cpuidex(info, leaf, 0);
+    if ((info[reg] & (1 << bit)) == 0)
+        return false;
+    if (xcr0_mask == 0)
+        return true;
+    __cpuid(info, 1);
+    bool os_uses_xsave = (info[2] & (1 << 27)) != 0;
+    return os_uses_xsave && (_xgetbv(0) & xcr0_mask) == xcr0_mask;
+}
+#endif
+
+// Checks if the processor we are running on supports SSE2
+bool cpu_has_sse2() {
+#if !STEG_X86
+    return false;
+#elif defined(_MSC_VER)
+    static bool const result = msvc_cpu_has(1, 3, 26, 0);
+    return result;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+// Checks if the processor we are running on supports AVX2
+bool cpu_has_avx2() {
+#if !STEG_X86
+    return false;
+#elif defined(_MSC_VER)
+    static bool const result = msvc_cpu_has(7, 1, 5, 0x6);
+    return result;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// Checks if the processor we are running on supports AVX-512 with byte and word instructions
+bool cpu_has_avx512bw() {
+#if !STEG_X86
+    return false;
+#elif defined(_MSC_VER)
+    static bool const result = msvc_cpu_has(7, 1, 16, 0xE6) && msvc_cpu_has(7, 1, 30, 0xE6);
+    return result;
+#else
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+}
+
+// A fixed set of worker threads which run the pieces of a parallel_for(...)
+//
+// The thread that calls run(...) also works on the tasks, so a pool for N threads only starts N - 1
+// workers. Only one run(...) can be in progress at a time.
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    std::function<void(size_t)> const* task = nullptr;
+    size_t task_count = 0;
+    size_t next_task = 0;
+    size_t tasks_unfinished = 0;
+    u64 generation = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    explicit ThreadPool(size_t thread_count) {
+        for (size_t i = 1; i < thread_count; i++) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    // Takes tasks until there are none left. Must be called with the mutex locked.
+    void do_tasks(std::unique_lock<std::mutex>& lock) {
+        while (next_task < task_count) {
+            size_t task_index = next_task++;
+            lock.unlock();
+            try {
+                (*task)(task_index);
+            } catch (...) {
+                lock.lock();
+                if (!error)
+                    error = std::current_exception();
+                lock.unlock();
+            }
+            lock.lock();
+            if (--tasks_unfinished == 0)
+                work_done.notify_all();
+        }
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        u64 seen_generation = 0;
+        while (true) {
+            work_ready.wait(lock, [&] { return stopping || generation != seen_generation; });
+            if (stopping)
+                return;
+            seen_generation = generation;
+            do_tasks(lock);
+        }
+    }
+
+    // Calls task(i) for every i in [0, count), spread across the threads, and waits for all of them
+    // to finish. If any of the tasks throw, the first exception is rethrown here.
+    void run(size_t count, std::function<void(size_t)> const& task_) {
+        std::unique_lock<std::mutex> lock(mutex);
+        task = &task_;
+        task_count = count;
+        next_task = 0;
+        tasks_unfinished = count;
+        error = nullptr;
+        ++generation;
+        work_ready.notify_all();
+
+        do_tasks(lock);
+        work_done.wait(lock, [&] { return tasks_unfinished == 0; });
+
+        task = nullptr;
+        task_count = 0;
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+static std::unique_ptr<ThreadPool> thread_pool;
+static size_t thread_count = 0;
+
+// Sets the number of threads used by parallel_for(...). 0 means one per processor core.
+void set_thread_count(size_t count) {
+    if (count == 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+
+    if (count != thread_count) {
+        thread_pool.reset();
+        thread_count = count;
+    }
+}
+
+// Gets the number of threads used by parallel_for(...)
+size_t get_thread_count() {
+    if (thread_count == 0)
+        set_thread_count(0);
+    return thread_count;
+}
+
+// Splits [0, count) into one contiguous range per thread, and calls fn(begin, end) for each range
+// on its own thread
+//
+// The ranges only depend on <count> and the thread count, never on timing, so as long as fn writes
+// to separate places for separate ranges, the results are the same every time and the same as
+// running on a single thread.
+void parallel_for(size_t count, std::function<void(size_t, size_t)> const& fn) {
+    size_t range_count = std::min(get_thread_count(), count);
+    if (range_count <= 1) {
+        if (count > 0)
+            fn(0, count);
+        return;
+    }
+
+    if (!thread_pool)
+        thread_pool = std::make_unique<ThreadPool>(thread_count);
+
+    thread_pool->run(range_count, [&](size_t range_index) {
+        size_t begin = count * range_index / range_count;
+        size_t end = count * (range_index + 1) / range_count;
+        fn(begin, end);
+    });
+}
+
 #ifdef STEG_TEST
 
 #include <gtest/gtest.h>
@@ -166,4 +547,42 @@ TEST(utility, set_bit) {
     }
 }
 
+TEST(utility, parallel_for) {
+    auto original_thread_count = get_thread_count();
+
+    for (size_t threads = 1; threads <= 5; threads++) {
+        set_thread_count(threads);
+        for (size_t count : {0, 1, 3, 100}) {
+            std::vector<int> visits(count);
+            parallel_for(count, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                    visits[i]++;
+            });
+            ASSERT_EQ(visits, std::vector<int>(count, 1));
+        }
+
+        auto throwing = [](size_t, size_t) { throw std::runtime_error("task failed"); };
+        ASSERT_THROW(parallel_for(10, throwing), std::runtime_error);
+    }
+
+    set_thread_count(original_thread_count);
+}
+
+TEST(utility, file_contents) {
+    std::string filename = "steg_test_file_contents.bin";
+    for (size_t size : {0, 1, 5000}) {
+        auto bytes = random_bytes(size);
+        {
+            std::ofstream file(filename, std::ios::binary);
+            file.write((char const*)bytes.data(), (std::streamsize)bytes.size());
+        }
+
+        FileContents contents(filename);
+        ASSERT_EQ(std::vector<u8>(contents.bytes.begin(), contents.bytes.end()), bytes);
+    }
+    std::remove(filename.c_str());
+
+    ASSERT_THROW(FileContents("steg_test_missing_file.bin"), std::runtime_error);
+}
+
 #endif // STEG_TEST